@@ -0,0 +1,1179 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "map.h"
+#include "store.h"
+
+// Benchmarks are seeded so that every run executes the same sequence of
+// operations and results can be compared between versions. Each result is a
+// CSV row on stdout:
+//
+// bench,workload,dist,slots,pages,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,extra
+//
+// slots is the size of the page cache and pages is the number of pages
+// allocated in the store, so slots < pages means the working set doesn't fit.
+// extra holds benchmark specific key=value pairs separated by ';'.
+
+#define BENCH_SEED 0x9e3779b97f4a7c15
+#define BENCH_RECORDS 16000
+#define BENCH_OPS 100000
+#define BENCH_DISK_PAGES 8192
+#define BENCH_VALUE_SIZE 32
+#define ZIPF_THETA 0.99
+#define BENCH_STORE_WINDOW 32 /* outstanding requests per client */
+#define BENCH_BATCH 256         /* lookups per map_get_batch */
+
+static char *bench_store_file = "bench.store";
+
+typedef struct Rng Rng;
+struct Rng {
+    uint64_t state;
+};
+
+// xorshift64*
+static uint64_t rng_next(Rng *rng) {
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545f4914f6cdd1d;
+}
+
+static double rng_double(Rng *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static uint64_t fnv(uint64_t x) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < 8; i++) {
+        hash ^= x & 0xff;
+        hash *= 0x100000001b3;
+        x >>= 8;
+    }
+
+    return hash;
+}
+
+// Zipfian generator from Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases", as used by YCSB. Ranks are scrambled so the hot keys
+// are spread over the key space rather than clustered at the start
+typedef struct Zipf Zipf;
+struct Zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        sum += 1 / pow(i, theta);
+    }
+
+    return sum;
+}
+
+static void zipf_init(Zipf *zipf, uint64_t n, double theta) {
+    double zeta2 = zeta(2, theta);
+
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1 / (1 - theta);
+    zipf->zetan = zeta(n, theta);
+    zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf->zetan);
+}
+
+static uint64_t zipf_next(Zipf *zipf, Rng *rng) {
+    double u = rng_double(rng);
+    double uz = u * zipf->zetan;
+
+    uint64_t rank = 0;
+    if (uz < 1) {
+        rank = 0;
+    } else if (uz < 1 + pow(0.5, zipf->theta)) {
+        rank = 1;
+    } else {
+        rank = zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+    }
+
+    return fnv(rank) % zipf->n;
+}
+
+typedef enum { DIST_UNIFORM, DIST_ZIPF } Dist;
+static char *dist_names[] = {"uniform", "zipf"};
+
+typedef struct KeyGen KeyGen;
+struct KeyGen {
+    Dist dist;
+    uint64_t n;
+    Zipf zipf;
+    Rng rng;
+};
+
+static void keygen_init(KeyGen *gen, Dist dist, uint64_t n) {
+    gen->dist = dist;
+    gen->n = n;
+    gen->rng = (Rng){.state = BENCH_SEED};
+    if (dist == DIST_ZIPF) {
+        zipf_init(&gen->zipf, n, ZIPF_THETA);
+    }
+}
+
+static uint64_t keygen_next(KeyGen *gen) {
+    if (gen->dist == DIST_ZIPF) {
+        return zipf_next(&gen->zipf, &gen->rng);
+    }
+
+    return rng_next(&gen->rng) % gen->n;
+}
+
+static size_t format_key(char *key, uint64_t i) {
+    return snprintf(key, 32, "user%012llu", (unsigned long long)i);
+}
+
+static void format_value(char *value, uint64_t i, uint64_t version) {
+    for (size_t j = 0; j < BENCH_VALUE_SIZE; j++) {
+        value[j] = 'a' + (i + version + j) % 26;
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct Latencies Latencies;
+struct Latencies {
+    size_t len;
+    uint64_t *ns;
+    uint64_t total_ns;
+};
+
+static void latencies_init(Latencies *lat, size_t cap) {
+    lat->len = 0;
+    lat->ns = calloc(cap, sizeof(uint64_t));
+    lat->total_ns = 0;
+}
+
+static void latencies_record(Latencies *lat, uint64_t start) {
+    uint64_t ns = now_ns() - start;
+    lat->ns[lat->len++] = ns;
+    lat->total_ns += ns;
+}
+
+static int _cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const Latencies *lat, double p) {
+    size_t i = (size_t)(p * (lat->len - 1));
+    return lat->ns[i];
+}
+
+static void report(char *bench, char *workload, char *dist, size_t slots,
+                   pageid_t pages, Latencies *lat, char *extra) {
+    qsort(lat->ns, lat->len, sizeof(uint64_t), _cmp_u64);
+
+    double ops_per_sec = lat->len / (lat->total_ns / 1e9);
+    printf("%s,%s,%s,%zu,%u,%zu,%.0f,%llu,%llu,%llu,%s\n", bench, workload,
+           dist, slots, pages, lat->len, ops_per_sec,
+           (unsigned long long)percentile(lat, 0.50),
+           (unsigned long long)percentile(lat, 0.99),
+           (unsigned long long)percentile(lat, 0.999), extra);
+    fflush(stdout);
+
+    free(lat->ns);
+    *lat = (Latencies){0};
+}
+
+// For benchmarks timed as a whole, the percentiles are left empty
+static void report_total(char *bench, char *workload, char *dist, size_t slots,
+                         pageid_t pages, size_t ops, uint64_t total_ns,
+                         char *extra) {
+    printf("%s,%s,%s,%zu,%u,%zu,%.0f,,,,%s\n", bench, workload, dist, slots,
+           pages, ops, ops / (total_ns / 1e9), extra);
+    fflush(stdout);
+}
+
+static void must(bool ok, char *what) {
+    if (!ok) {
+        printf("bench: %s failed\n", what);
+        exit(1);
+    }
+}
+
+// YCSB core workloads, as the percentage of reads with the rest being updates
+// or, for F, read-modify-writes
+typedef struct Workload Workload;
+struct Workload {
+    char *name;
+    int read_pct;
+    bool rmw;
+};
+
+static Workload workloads[] = {
+    {.name = "A", .read_pct = 50, .rmw = false},
+    {.name = "B", .read_pct = 95, .rmw = false},
+    {.name = "C", .read_pct = 100, .rmw = false},
+    {.name = "F", .read_pct = 50, .rmw = true},
+};
+
+static void bench_map_load(Map *map, size_t slots, size_t records) {
+    char key[32], value[BENCH_VALUE_SIZE];
+
+    Latencies lat = {0};
+    latencies_init(&lat, records);
+    for (uint64_t i = 0; i < records; i++) {
+        size_t klen = format_key(key, i);
+        format_value(value, i, 0);
+
+        uint64_t start = now_ns();
+        must(map_insert(map, key, klen, value, sizeof(value)), "map_insert");
+        latencies_record(&lat, start);
+    }
+
+    report("map", "load", "seq", slots, map->pc->dm.meta->next, &lat, "");
+}
+
+static void bench_map_run(Map *map, size_t slots, size_t records, size_t ops,
+                          Workload *workload, Dist dist) {
+    char key[32], value[BENCH_VALUE_SIZE];
+
+    KeyGen gen = {0};
+    keygen_init(&gen, dist, records);
+    Rng op_rng = {.state = BENCH_SEED ^ 1};
+    HotStats before = map->hot != NULL ? map->hot->stats : (HotStats){0};
+
+    Latencies lat = {0};
+    latencies_init(&lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        uint64_t k = keygen_next(&gen);
+        size_t klen = format_key(key, k);
+        bool read = (int)(rng_next(&op_rng) % 100) < workload->read_pct;
+
+        char *ivalue = NULL;
+        size_t ivlen = 0;
+        uint64_t start = now_ns();
+        if (read || workload->rmw) {
+            must(map_get(map, key, klen, &ivalue, &ivlen), "map_get");
+        }
+        if (!read) {
+            format_value(value, k, i);
+            must(map_insert(map, key, klen, value, sizeof(value)),
+                 "map_insert");
+        }
+        latencies_record(&lat, start);
+    }
+
+    char extra[64] = "";
+    if (map->hot != NULL) {
+        HotStats *stats = &map->hot->stats;
+        size_t hits = stats->hits - before.hits;
+        size_t misses = stats->misses - before.misses;
+        snprintf(extra, sizeof(extra), "hot_kb=%zu;hot_hit_rate=%.3f",
+                 map->hot->budget / 1024, (double)hits / (hits + misses));
+    }
+    report("map", workload->name, dist_names[dist], slots,
+           map->pc->dm.meta->next, &lat, extra);
+}
+
+// Lookups of keys that were never inserted, reporting how many the filters
+// answered and how much memory they take
+static void bench_map_miss(Map *map, size_t slots, size_t records, size_t ops,
+                           Dist dist) {
+    char key[32];
+
+    KeyGen gen = {0};
+    keygen_init(&gen, dist, records);
+    MapStats before = map->stats;
+
+    Latencies lat = {0};
+    latencies_init(&lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        // Offset past the loaded records so every key misses
+        size_t klen = format_key(key, records + keygen_next(&gen));
+
+        char *ivalue = NULL;
+        size_t ivlen = 0;
+        uint64_t start = now_ns();
+        must(!map_get(map, key, klen, &ivalue, &ivlen), "map_get miss");
+        latencies_record(&lat, start);
+    }
+
+    size_t negatives =
+        map->stats.filter_negatives - before.filter_negatives;
+    size_t false_positives =
+        map->stats.filter_false_positives - before.filter_false_positives;
+    size_t unpinned = map->stats.filter_unpinned - before.filter_unpinned;
+    size_t filter_pages = 0;
+    for (size_t p = 0; p < DIRECTORY_FILTER_PAGES; p++) {
+        filter_pages += map->filter_pages[p] != NULL;
+    }
+
+    char extra[128];
+    snprintf(extra, sizeof(extra),
+             "fp_rate=%.4f;filter_bits_per_key=%.2f;unfiltered=%zu",
+             (double)false_positives / (negatives + false_positives),
+             (double)filter_pages * PAGE_SIZE * 8 / records, unpinned);
+    report("map", "miss", dist_names[dist], slots, map->pc->dm.meta->next,
+           &lat, extra);
+}
+
+typedef struct BenchLoad BenchLoad;
+struct BenchLoad {
+    uint64_t i;
+    uint64_t records;
+    char key[32];
+    char value[BENCH_VALUE_SIZE];
+};
+
+static bool _bench_load_next(void *ctx, char **key, size_t *klen,
+                             char **value, size_t *vlen) {
+    BenchLoad *load = ctx;
+    if (load->i == load->records) {
+        return false;
+    }
+
+    *klen = format_key(load->key, load->i);
+    format_value(load->value, load->i, 0);
+    *key = load->key;
+    *value = load->value;
+    *vlen = BENCH_VALUE_SIZE;
+    load->i++;
+
+    return true;
+}
+
+// The same records as bench_map_load, through map_bulk_load
+static void bench_map_bulk(size_t slots, size_t records) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    uint64_t start = now_ns();
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+    pageid_t pages = pc.dm.meta->next;
+    map_close(&map);
+    cache_close(&pc);
+    uint64_t total_ns = now_ns() - start;
+
+    report_total("map", "bulk", "seq", slots, pages, records, total_ns, "");
+    remove(bench_store_file);
+}
+
+static void bench_map(size_t slots, size_t records, size_t ops) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    bench_map_load(&map, slots, records);
+    for (size_t d = 0; d < sizeof(dist_names) / sizeof(dist_names[0]); d++) {
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            bench_map_run(&map, slots, records, ops, &workloads[w], d);
+        }
+        bench_map_miss(&map, slots, records, ops, d);
+    }
+
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+}
+
+// Raw DiskManager throughput, with the file grown in preallocated extents or a
+// page at a time. There is no O_DIRECT, so reads of recently written pages may
+// be served by the OS page cache
+static void bench_disk(size_t npages, bool preallocate) {
+    remove(bench_store_file);
+
+    DiskManager dm = {0};
+    disk_open(bench_store_file, &dm);
+    dm.preallocate = preallocate;
+    char *extra = preallocate ? "preallocate=1" : "preallocate=0";
+
+    char *data = calloc(1, PAGE_SIZE);
+    pageid_t *pids = calloc(npages, sizeof(pageid_t));
+    Rng rng = {.state = BENCH_SEED};
+    Latencies lat = {0};
+
+    latencies_init(&lat, npages);
+    for (size_t i = 0; i < npages; i++) {
+        uint64_t start = now_ns();
+        pids[i] = disk_alloc(&dm);
+        memset(data, (int)i, PAGE_SIZE);
+        disk_write(&dm, pids[i], data);
+        latencies_record(&lat, start);
+    }
+    report("disk", "write", "seq", 0, dm.meta->next, &lat, extra);
+
+    latencies_init(&lat, npages);
+    for (size_t i = 0; i < npages; i++) {
+        uint64_t start = now_ns();
+        disk_read(&dm, pids[i], data);
+        latencies_record(&lat, start);
+    }
+    report("disk", "read", "seq", 0, dm.meta->next, &lat, extra);
+
+    latencies_init(&lat, npages);
+    for (size_t i = 0; i < npages; i++) {
+        pageid_t pid = pids[rng_next(&rng) % npages];
+        uint64_t start = now_ns();
+        disk_read(&dm, pid, data);
+        latencies_record(&lat, start);
+    }
+    report("disk", "read", "uniform", 0, dm.meta->next, &lat, extra);
+
+    latencies_init(&lat, npages);
+    for (size_t i = 0; i < npages; i++) {
+        pageid_t pid = pids[rng_next(&rng) % npages];
+        uint64_t start = now_ns();
+        disk_write(&dm, pid, data);
+        latencies_record(&lat, start);
+    }
+    report("disk", "write", "uniform", 0, dm.meta->next, &lat, extra);
+
+    free(pids);
+    free(data);
+    disk_close(&dm);
+    remove(bench_store_file);
+}
+
+// Push the file out of the OS page cache so the next reads go to the device.
+// Where that isn't possible the cold runs are only cold for the page cache
+static void bench_drop_os_cache(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    fsync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+}
+
+// YCSB B on a reopened map with the frame pool or the mapping. The first pass
+// starts with the file out of the OS page cache and the second runs on
+// whatever the first left resident
+static void bench_map_mmap(size_t slots, size_t records, size_t ops,
+                           bool mmap) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+    pageid_t directory_pid = map.directory_pid;
+    map_close(&map);
+    cache_close(&pc);
+
+    bench_drop_os_cache(bench_store_file);
+
+    if (mmap) {
+        cache_init_mmap(bench_store_file, slots, &pc);
+        disk_advise(&pc.dm, DISK_ADVICE_RANDOM);
+    } else {
+        cache_init_slots(bench_store_file, slots, &pc);
+    }
+    map_open(&map, &pc, directory_pid);
+
+    char key[32], value[BENCH_VALUE_SIZE];
+    char *passes[] = {"cold", "hot"};
+    for (size_t p = 0; p < sizeof(passes) / sizeof(passes[0]); p++) {
+        KeyGen gen = {0};
+        keygen_init(&gen, DIST_UNIFORM, records);
+        Rng op_rng = {.state = BENCH_SEED ^ 1};
+
+        Latencies lat = {0};
+        latencies_init(&lat, ops);
+        for (size_t i = 0; i < ops; i++) {
+            uint64_t k = keygen_next(&gen);
+            size_t klen = format_key(key, k);
+            bool read = (int)(rng_next(&op_rng) % 100) < workloads[1].read_pct;
+
+            char *ivalue = NULL;
+            size_t ivlen = 0;
+            uint64_t start = now_ns();
+            if (read) {
+                must(map_get(&map, key, klen, &ivalue, &ivlen), "map_get");
+            } else {
+                format_value(value, k, i);
+                must(map_insert(&map, key, klen, value, sizeof(value)),
+                     "map_insert");
+            }
+            latencies_record(&lat, start);
+        }
+
+        char extra[64];
+        snprintf(extra, sizeof(extra), "mode=%s;os_cache=%s",
+                 mmap ? "mmap" : "frames", passes[p]);
+        report("map", workloads[1].name, "uniform", slots, pc.dm.meta->next,
+               &lat, extra);
+    }
+
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+}
+
+// YCSB C after a restart, with and without reloading the resident set that
+// the previous run left behind. Startup covers opening the cache and, for a
+// warm restart, reading the pages back
+static void bench_map_restart(size_t slots, size_t records, size_t ops,
+                              bool warm) {
+    char warm_file[64];
+    snprintf(warm_file, sizeof(warm_file), "%s.warm", bench_store_file);
+    remove(bench_store_file);
+    remove(warm_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+    cache_warm(&pc, warm_file, 0);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+    pageid_t directory_pid = map.directory_pid;
+
+    char key[32];
+    char *value = NULL;
+    size_t vlen = 0;
+    KeyGen gen = {0};
+    keygen_init(&gen, DIST_ZIPF, records);
+    for (size_t i = 0; i < ops; i++) {
+        size_t klen = format_key(key, keygen_next(&gen));
+        must(map_get(&map, key, klen, &value, &vlen), "map_get");
+    }
+    map_close(&map);
+    cache_close(&pc);
+
+    bench_drop_os_cache(bench_store_file);
+
+    uint64_t open_start = now_ns();
+    cache_init_slots(bench_store_file, slots, &pc);
+    size_t reloaded = warm ? cache_warm(&pc, warm_file, 0) : 0;
+    uint64_t startup_ns = now_ns() - open_start;
+    map_open(&map, &pc, directory_pid);
+
+    keygen_init(&gen, DIST_ZIPF, records);
+    Latencies lat = {0};
+    latencies_init(&lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        size_t klen = format_key(key, keygen_next(&gen));
+        uint64_t start = now_ns();
+        must(map_get(&map, key, klen, &value, &vlen), "map_get");
+        latencies_record(&lat, start);
+    }
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "restart=%s;reloaded=%zu;startup_us=%llu",
+             warm ? "warm" : "cold", reloaded,
+             (unsigned long long)(startup_ns / 1000));
+    report("map", "C", "zipf", slots, pc.dm.meta->next, &lat, extra);
+
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+    remove(warm_file);
+}
+
+// Uniform reads through sequential map_get calls or interleaved through
+// map_get_batch, starting with the file out of the OS page cache
+static void bench_map_batch(size_t slots, size_t records, size_t ops,
+                            bool batch, bool readahead) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+    pageid_t directory_pid = map.directory_pid;
+    map_close(&map);
+    cache_close(&pc);
+
+    bench_drop_os_cache(bench_store_file);
+    cache_init_slots(bench_store_file, slots, &pc);
+    map_open(&map, &pc, directory_pid);
+    map.readahead = readahead;
+
+    char(*keys)[32] = calloc(BENCH_BATCH, sizeof(*keys));
+    char(*values)[BENCH_VALUE_SIZE] = calloc(BENCH_BATCH, sizeof(*values));
+    MapLookup *lookups = calloc(BENCH_BATCH, sizeof(MapLookup));
+    KeyGen gen = {0};
+    keygen_init(&gen, DIST_UNIFORM, records);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < ops; i += BENCH_BATCH) {
+        size_t n = ops - i < BENCH_BATCH ? ops - i : BENCH_BATCH;
+        for (size_t j = 0; j < n; j++) {
+            lookups[j] = (MapLookup){
+                .key = keys[j],
+                .klen = format_key(keys[j], keygen_next(&gen)),
+                .value = values[j],
+                .vlen = BENCH_VALUE_SIZE,
+            };
+        }
+
+        if (batch) {
+            must(map_get_batch(&map, lookups, n) == n, "map_get_batch");
+            continue;
+        }
+
+        for (size_t j = 0; j < n; j++) {
+            char *value = NULL;
+            size_t vlen = 0;
+            must(map_get(&map, lookups[j].key, lookups[j].klen, &value, &vlen),
+                 "map_get");
+            memcpy(lookups[j].value, value, vlen);
+        }
+    }
+    uint64_t total_ns = now_ns() - start;
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "lookup=%s;group=%d;readahead=%d",
+             batch ? "batch" : "sequential", batch ? MAP_LOOKUP_GROUP : 1,
+             readahead);
+    report_total("map", "C", "uniform", slots, pc.dm.meta->next, ops, total_ns,
+                 extra);
+
+    free(lookups);
+    free(values);
+    free(keys);
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+}
+
+// YCSB C on a pool too small for the map, with and without the compressed
+// tier. The tier gets the given number of pages worth of memory, so it can be
+// compared with a pool that has that many more slots
+static void bench_map_tier(size_t slots, size_t tier_pages, size_t records,
+                           size_t ops, Dist dist) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+    pageid_t directory_pid = map.directory_pid;
+    map_close(&map);
+    cache_close(&pc);
+
+    cache_init_slots(bench_store_file, slots, &pc);
+    if (tier_pages > 0) {
+        cache_tier_init(&pc, tier_pages * PAGE_SIZE);
+    }
+    map_open(&map, &pc, directory_pid);
+
+    char key[32];
+    char *value = NULL;
+    size_t vlen = 0;
+    KeyGen gen = {0};
+    keygen_init(&gen, dist, records);
+
+    Latencies lat = {0};
+    latencies_init(&lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        size_t klen = format_key(key, keygen_next(&gen));
+        uint64_t start = now_ns();
+        must(map_get(&map, key, klen, &value, &vlen), "map_get");
+        latencies_record(&lat, start);
+    }
+
+    char extra[128] = "tier_kb=0";
+    if (tier_pages > 0) {
+        TierStats *stats = &pc.tier->stats;
+        snprintf(extra, sizeof(extra),
+                 "tier_kb=%zu;tier_hit_rate=%.3f;tier_ratio=%.2f;"
+                 "tier_rejected=%zu",
+                 tier_pages * PAGE_SIZE / 1024,
+                 (double)stats->hits / (stats->hits + stats->misses),
+                 (double)stats->bytes_in / stats->bytes_stored,
+                 stats->rejected);
+    }
+    report("map", "C", dist_names[dist], slots, pc.dm.meta->next, &lat, extra);
+
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+}
+
+// Read heavy workloads with and without a hot cache in front of the map. The
+// pool holds the whole map, so the cache saves the pins and bucket searches
+// rather than disk reads
+static void bench_map_hot(size_t slots, size_t hot_bytes, size_t records,
+                          size_t ops, Dist dist) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+    if (hot_bytes > 0) {
+        map_hot_init(&map, hot_bytes);
+    }
+
+    // B then C, so C runs with the cache warmed by B
+    bench_map_run(&map, slots, records, ops, &workloads[1], dist);
+    bench_map_run(&map, slots, records, ops, &workloads[2], dist);
+
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+}
+
+typedef struct BenchClient BenchClient;
+struct BenchClient {
+    Store *store;
+    size_t id;
+    size_t records;
+    size_t ops;
+    Latencies lat;
+};
+
+// Run YCSB B against the store, keeping a window of requests outstanding
+static void *_bench_store_client(void *arg) {
+    BenchClient *client = arg;
+    Workload *workload = &workloads[1];
+
+    KeyGen gen = {0};
+    keygen_init(&gen, DIST_UNIFORM, client->records);
+    gen.rng.state ^= client->id;
+    Rng op_rng = {.state = (BENCH_SEED ^ 1) + client->id};
+
+    StoreRequest *requests = calloc(BENCH_STORE_WINDOW, sizeof(StoreRequest));
+    uint64_t starts[BENCH_STORE_WINDOW] = {0};
+    bool pending[BENCH_STORE_WINDOW] = {0};
+
+    latencies_init(&client->lat, client->ops);
+    size_t issued = 0, completed = 0;
+    while (completed < client->ops) {
+        bool progress = false;
+        for (size_t w = 0; w < BENCH_STORE_WINDOW; w++) {
+            StoreRequest *request = &requests[w];
+            if (pending[w] && store_done(request)) {
+                must(request->ok, "store request");
+                latencies_record(&client->lat, starts[w]);
+                pending[w] = false;
+                completed++;
+                progress = true;
+            }
+
+            if (pending[w] || issued == client->ops) {
+                continue;
+            }
+
+            uint64_t k = keygen_next(&gen);
+            request->klen = format_key(request->key, k);
+            request->op = STORE_GET;
+            if ((int)(rng_next(&op_rng) % 100) >= workload->read_pct) {
+                request->op = STORE_INSERT;
+                request->vlen = BENCH_VALUE_SIZE;
+                format_value(request->value, k, issued);
+            }
+
+            starts[w] = now_ns();
+            if (store_submit(client->store, client->id, request)) {
+                pending[w] = true;
+                issued++;
+                progress = true;
+            }
+        }
+
+        if (!progress) {
+            sched_yield();
+        }
+    }
+
+    free(requests);
+
+    return NULL;
+}
+
+// Partitioned store with one client per partition, over the same records
+static void bench_store(size_t partitions, size_t records, size_t ops) {
+    Store store = {0};
+    store_open(bench_store_file, partitions, partitions, &store);
+
+    char key[32], value[BENCH_VALUE_SIZE];
+    for (uint64_t i = 0; i < records; i++) {
+        size_t klen = format_key(key, i);
+        format_value(value, i, 0);
+        must(store_insert(&store, 0, key, klen, value, sizeof(value)),
+             "store_insert");
+    }
+
+    BenchClient *clients = calloc(partitions, sizeof(BenchClient));
+    pthread_t *threads = calloc(partitions, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (size_t c = 0; c < partitions; c++) {
+        clients[c] = (BenchClient){
+            .store = &store, .id = c, .records = records, .ops = ops};
+        pthread_create(&threads[c], NULL, _bench_store_client, &clients[c]);
+    }
+    for (size_t c = 0; c < partitions; c++) {
+        pthread_join(threads[c], NULL);
+    }
+    uint64_t total_ns = now_ns() - start;
+
+    // Throughput is over the wall time of all clients
+    Latencies lat = {0};
+    latencies_init(&lat, ops * partitions);
+    for (size_t c = 0; c < partitions; c++) {
+        memcpy(lat.ns + lat.len, clients[c].lat.ns,
+               clients[c].lat.len * sizeof(uint64_t));
+        lat.len += clients[c].lat.len;
+        free(clients[c].lat.ns);
+    }
+    lat.total_ns = total_ns;
+
+    char extra[96];
+    snprintf(extra, sizeof(extra), "partitions=%zu;threads=%zu;cores=%ld",
+             partitions, 2 * partitions, sysconf(_SC_NPROCESSORS_ONLN));
+    report("store", "B", "uniform", CACHE_SLOTS * partitions, 0, &lat, extra);
+
+    free(threads);
+    free(clients);
+    store_close(&store);
+
+    char path[64];
+    for (size_t p = 0; p < partitions; p++) {
+        snprintf(path, sizeof(path), "%s.%zu", bench_store_file, p);
+        remove(path);
+    }
+}
+
+typedef struct BenchReader BenchReader;
+struct BenchReader {
+    Map *map;
+    size_t id;
+    size_t records;
+    size_t ops;
+    Latencies lat;
+};
+
+static void *_bench_reader(void *arg) {
+    BenchReader *reader = arg;
+
+    KeyGen gen = {0};
+    keygen_init(&gen, DIST_UNIFORM, reader->records);
+    gen.rng.state ^= reader->id;
+
+    char key[32], value[BENCH_VALUE_SIZE];
+    latencies_init(&reader->lat, reader->ops);
+    for (size_t i = 0; i < reader->ops; i++) {
+        size_t klen = format_key(key, keygen_next(&gen));
+        size_t vlen = sizeof(value);
+
+        uint64_t start = now_ns();
+        must(map_read(reader->map, key, klen, value, &vlen), "map_read");
+        latencies_record(&reader->lat, start);
+    }
+
+    return NULL;
+}
+
+typedef struct BenchWriter BenchWriter;
+struct BenchWriter {
+    Map *map;
+    size_t records;
+    atomic_bool stop;
+    size_t writes;
+};
+
+// Update a random key every 10us until stopped
+static void *_bench_writer(void *arg) {
+    BenchWriter *writer = arg;
+
+    KeyGen gen = {0};
+    keygen_init(&gen, DIST_UNIFORM, writer->records);
+    gen.rng.state ^= 0xffff;
+
+    char key[32], value[BENCH_VALUE_SIZE];
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10000};
+    while (!atomic_load(&writer->stop)) {
+        uint64_t k = keygen_next(&gen);
+        size_t klen = format_key(key, k);
+        format_value(value, k, writer->writes);
+        must(map_insert(writer->map, key, klen, value, sizeof(value)),
+             "map_insert");
+        writer->writes++;
+        nanosleep(&pause, NULL);
+    }
+
+    return NULL;
+}
+
+// Readers calling map_read alongside one writer, with and without the
+// optimistic path
+static void bench_map_read(size_t slots, size_t records, size_t ops,
+                           size_t threads, bool optimistic) {
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+    map.optimistic = optimistic;
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+
+    BenchWriter writer = {.map = &map, .records = records};
+    atomic_init(&writer.stop, false);
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, NULL, _bench_writer, &writer);
+
+    BenchReader *readers = calloc(threads, sizeof(BenchReader));
+    pthread_t *reader_threads = calloc(threads, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (size_t t = 0; t < threads; t++) {
+        readers[t] = (BenchReader){
+            .map = &map, .id = t, .records = records, .ops = ops};
+        pthread_create(&reader_threads[t], NULL, _bench_reader, &readers[t]);
+    }
+    for (size_t t = 0; t < threads; t++) {
+        pthread_join(reader_threads[t], NULL);
+    }
+    uint64_t total_ns = now_ns() - start;
+
+    atomic_store(&writer.stop, true);
+    pthread_join(writer_thread, NULL);
+
+    Latencies lat = {0};
+    latencies_init(&lat, ops * threads);
+    for (size_t t = 0; t < threads; t++) {
+        memcpy(lat.ns + lat.len, readers[t].lat.ns,
+               readers[t].lat.len * sizeof(uint64_t));
+        lat.len += readers[t].lat.len;
+        free(readers[t].lat.ns);
+    }
+    lat.total_ns = total_ns;
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "threads=%zu;writes=%zu", threads,
+             writer.writes);
+    report("map", optimistic ? "read_optimistic" : "read_pinned", "uniform",
+           slots, pc.dm.meta->next, &lat, extra);
+
+    free(reader_threads);
+    free(readers);
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+}
+
+typedef struct BenchBackup BenchBackup;
+struct BenchBackup {
+    DiskSnapshot *snapshot;
+    char *path;
+    uint64_t ns;
+};
+
+static void *_bench_backup(void *arg) {
+    BenchBackup *backup = arg;
+
+    uint64_t start = now_ns();
+    disk_snapshot_backup(backup->snapshot, backup->path);
+    backup->ns = now_ns() - start;
+
+    return NULL;
+}
+
+// Uniform updates after a snapshot is taken, with and without a backup of the
+// snapshot written alongside them
+static void bench_map_snapshot(size_t slots, size_t records, size_t ops,
+                               bool backup) {
+    char backup_file[64];
+    snprintf(backup_file, sizeof(backup_file), "%s.backup", bench_store_file);
+    remove(bench_store_file);
+
+    PageCache pc = {0};
+    cache_init_slots(bench_store_file, slots, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    BenchLoad load = {.i = 0, .records = records};
+    must(map_bulk_load(&map, _bench_load_next, &load, 1 << 20),
+         "map_bulk_load");
+
+    uint64_t snapshot_start = now_ns();
+    DiskSnapshot snapshot = {0};
+    must(cache_snapshot(&pc, &snapshot), "cache_snapshot");
+    uint64_t snapshot_ns = now_ns() - snapshot_start;
+
+    BenchBackup task = {.snapshot = &snapshot, .path = backup_file};
+    pthread_t backup_thread;
+    if (backup) {
+        pthread_create(&backup_thread, NULL, _bench_backup, &task);
+    }
+
+    char key[32], value[BENCH_VALUE_SIZE];
+    KeyGen gen = {0};
+    keygen_init(&gen, DIST_UNIFORM, records);
+    Latencies lat = {0};
+    latencies_init(&lat, ops);
+    for (size_t i = 0; i < ops; i++) {
+        uint64_t k = keygen_next(&gen);
+        size_t klen = format_key(key, k);
+        format_value(value, k, i + 1);
+
+        uint64_t start = now_ns();
+        must(map_insert(&map, key, klen, value, sizeof(value)), "map_insert");
+        latencies_record(&lat, start);
+    }
+
+    if (backup) {
+        pthread_join(backup_thread, NULL);
+    }
+    pageid_t copied = pc.dm.meta->next - snapshot.next;
+    size_t backup_mb = ((size_t)snapshot.next + 1) * PAGE_SIZE >> 20;
+
+    char extra[96];
+    snprintf(extra, sizeof(extra),
+             "backup=%s;snapshot_us=%llu;backup_ms=%llu;backup_mb=%zu;"
+             "copied=%u",
+             backup ? "on" : "off", (unsigned long long)(snapshot_ns / 1000),
+             (unsigned long long)(task.ns / 1000000), backup_mb, copied);
+    report("map", "update", "uniform", slots, pc.dm.meta->next, &lat, extra);
+
+    cache_snapshot_release(&pc, &snapshot);
+    map_close(&map);
+    cache_close(&pc);
+    remove(bench_store_file);
+    remove(backup_file);
+}
+
+// usage: bench [ops]
+int main(int argc, char *argv[]) {
+    size_t ops = BENCH_OPS;
+    if (argc > 1) {
+        char *end = NULL;
+        ops = strtoull(argv[1], &end, 10);
+        if (argv[1][0] < '0' || argv[1][0] > '9' || *end != 0 || ops == 0) {
+            printf("usage: bench [ops]\n");
+            return 1;
+        }
+    }
+
+    printf("bench,workload,dist,slots,pages,ops,ops_per_sec,p50_ns,p99_ns,"
+           "p999_ns,extra\n");
+
+    // The map of BENCH_RECORDS uses a few hundred pages, so run with a pool
+    // that holds all of it and one that holds a fraction of it
+    bench_map(CACHE_SLOTS * 4, BENCH_RECORDS, ops);
+    bench_map(CACHE_SLOTS / 4, BENCH_RECORDS, ops);
+    bench_map_bulk(CACHE_SLOTS / 4, BENCH_RECORDS);
+
+    bench_disk(BENCH_DISK_PAGES, false);
+    bench_disk(BENCH_DISK_PAGES, true);
+
+    for (size_t slots = CACHE_SLOTS / 4; slots <= CACHE_SLOTS * 4;
+         slots *= 16) {
+        bench_map_mmap(slots, BENCH_RECORDS, ops, false);
+        bench_map_mmap(slots, BENCH_RECORDS, ops, true);
+    }
+
+    for (size_t slots = CACHE_SLOTS / 4; slots <= CACHE_SLOTS * 4;
+         slots *= 16) {
+        bench_map_restart(slots, BENCH_RECORDS, ops, false);
+        bench_map_restart(slots, BENCH_RECORDS, ops, true);
+    }
+
+    // The same memory as a larger pool or as a tier in front of the disk
+    for (size_t d = 0; d < sizeof(dist_names) / sizeof(dist_names[0]); d++) {
+        bench_map_tier(CACHE_SLOTS / 4, 0, BENCH_RECORDS, ops, d);
+        bench_map_tier(CACHE_SLOTS / 2, 0, BENCH_RECORDS, ops, d);
+        bench_map_tier(CACHE_SLOTS / 4, CACHE_SLOTS / 4, BENCH_RECORDS, ops, d);
+    }
+
+    // A tenth of the records fit in the hot cache
+    for (size_t d = 0; d < sizeof(dist_names) / sizeof(dist_names[0]); d++) {
+        bench_map_hot(CACHE_SLOTS * 4, 0, BENCH_RECORDS, ops, d);
+        bench_map_hot(CACHE_SLOTS * 4, BENCH_RECORDS / 10 * HOT_ENTRY_BUDGET,
+                      BENCH_RECORDS, ops, d);
+    }
+
+    for (size_t slots = CACHE_SLOTS / 4; slots <= CACHE_SLOTS * 4;
+         slots *= 16) {
+        bench_map_batch(slots, BENCH_RECORDS, ops, false, false);
+        bench_map_batch(slots, BENCH_RECORDS, ops, true, false);
+        bench_map_batch(slots, BENCH_RECORDS, ops, true, true);
+    }
+
+    for (size_t slots = CACHE_SLOTS / 4; slots <= CACHE_SLOTS * 4;
+         slots *= 16) {
+        bench_map_snapshot(slots, BENCH_RECORDS, ops, false);
+        bench_map_snapshot(slots, BENCH_RECORDS, ops, true);
+    }
+
+    // Partition workers and clients both busy poll, so each needs its own
+    // core for the sweep to show scaling rather than time slicing. A single
+    // partition still runs on a machine with fewer than two cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (size_t partitions = 1;
+         partitions == 1 || 2 * partitions <= (size_t)cores; partitions *= 2) {
+        bench_store(partitions, BENCH_RECORDS, ops);
+    }
+
+    for (size_t threads = 1; threads <= (size_t)cores; threads *= 2) {
+        for (size_t slots = CACHE_SLOTS / 4; slots <= CACHE_SLOTS * 4;
+             slots *= 16) {
+            bench_map_read(slots, BENCH_RECORDS, ops, threads, false);
+            bench_map_read(slots, BENCH_RECORDS, ops, threads, true);
+        }
+    }
+
+    return 0;
+}
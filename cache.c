@@ -1,35 +1,107 @@
 #include <assert.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "cache.h"
 #include "vec.h"
 
 VEC_IMPL(slotid_t)
 VEC_IMPL(LRUEntry)
-VEC_IMPL(PageSlot)
 
+#define PAGE_SLOT(pid, sid) ((uint64_t)(pid) << 32 | (sid))
+#define PAGE_SLOT_PID(slot) ((pageid_t)((slot) >> 32))
+#define PAGE_SLOT_SID(slot) ((slotid_t)((slot) & 0xffffffff))
+
+static size_t _ptable_index(const PageCache *pc, pageid_t pid) {
+    return ((uint64_t)pid * 0x9e3779b97f4a7c15 >> 32) & pc->ptable_mask;
+}
+
+// Readers may probe the page table without the latch, so entries are only
+// ever replaced with a single store
 static bool _find_cache_page(const PageCache *pc, pageid_t pid, slotid_t *sid) {
-    for (size_t i = 0; i < pc->ptable.len; i++) {
-        if (pc->ptable.data[i].pid == pid) {
-            *sid = pc->ptable.data[i].sid;
+    for (size_t i = _ptable_index(pc, pid);; i = (i + 1) & pc->ptable_mask) {
+        uint64_t slot =
+            atomic_load_explicit(&pc->ptable[i], memory_order_acquire);
+        if (slot == 0) {
+            return false;
+        }
 
+        if (PAGE_SLOT_PID(slot) == pid) {
+            *sid = PAGE_SLOT_SID(slot);
             return true;
         }
     }
-
-    return false;
 }
 
 static void _insert_cache_page(PageCache *pc, pageid_t pid, slotid_t sid) {
-    for (size_t i = 0; i < pc->ptable.len; i++) {
-        if (pc->ptable.data[i].pid == pid) {
-            pc->ptable.data[i].sid = sid;
+    for (size_t i = _ptable_index(pc, pid);; i = (i + 1) & pc->ptable_mask) {
+        uint64_t slot =
+            atomic_load_explicit(&pc->ptable[i], memory_order_relaxed);
+        if (slot == 0 || PAGE_SLOT_PID(slot) == pid) {
+            atomic_store_explicit(&pc->ptable[i], PAGE_SLOT(pid, sid),
+                                  memory_order_release);
             return;
         }
     }
+}
+
+// Backward shift deletion. An entry that is moved is written to its new
+// position before the old one is cleared, but a probe without the latch can
+// still miss it: if the probe has already passed the new position when the
+// entry moves, it finds the old position cleared or reused. A lock-free miss
+// is only a hint, and callers must confirm it under the latch
+static void _remove_cache_page(PageCache *pc, pageid_t pid) {
+    size_t i = _ptable_index(pc, pid);
+    for (;; i = (i + 1) & pc->ptable_mask) {
+        uint64_t slot =
+            atomic_load_explicit(&pc->ptable[i], memory_order_relaxed);
+        if (slot == 0) {
+            return;
+        }
+
+        if (PAGE_SLOT_PID(slot) == pid) {
+            break;
+        }
+    }
+
+    for (size_t j = (i + 1) & pc->ptable_mask;; j = (j + 1) & pc->ptable_mask) {
+        uint64_t slot =
+            atomic_load_explicit(&pc->ptable[j], memory_order_relaxed);
+        if (slot == 0) {
+            break;
+        }
+
+        // Move the entry back if its home is not between the hole and it
+        size_t home = _ptable_index(pc, PAGE_SLOT_PID(slot));
+        if (((j - home) & pc->ptable_mask) >= ((j - i) & pc->ptable_mask)) {
+            atomic_store_explicit(&pc->ptable[i], slot, memory_order_release);
+            i = j;
+        }
+    }
+
+    atomic_store_explicit(&pc->ptable[i], 0, memory_order_release);
+}
+
+// Pick a slot to evict. Pages read without a pin don't go through the LRU, so
+// a referenced page gets its access recorded and another chance
+static bool _evict(PageCache *pc, slotid_t *sid) {
+    for (size_t i = 0; i < pc->slots; i++) {
+        if (!lru_evict(&pc->lru, sid)) {
+            return false;
+        }
+
+        if (!atomic_exchange_explicit(&pc->pages[*sid].referenced, false,
+                                      memory_order_relaxed)) {
+            return true;
+        }
+
+        lru_access(&pc->lru, *sid);
+    }
 
-    vec_push_PageSlot(&pc->ptable, (PageSlot){.pid = pid, .sid = sid});
+    return lru_evict(&pc->lru, sid);
 }
 
 // Attempt to find a free/evictable slot in the page cache to hold the page
@@ -37,9 +109,14 @@ static void _insert_cache_page(PageCache *pc, pageid_t pid, slotid_t sid) {
 static bool _try_get_page(PageCache *pc, pageid_t pid, Page **page) {
     // Try to find a free page
     slotid_t sid = 0;
-    if (!vec_pop_slotid_t(&pc->free, &sid) && !lru_evict(&pc->lru, &sid)) {
-        // There is no free or evicatable page
-        return false;
+    bool evicted = false;
+    if (!vec_pop_slotid_t(&pc->free, &sid)) {
+        if (!_evict(pc, &sid)) {
+            // There is no free or evicatable page
+            return false;
+        }
+
+        evicted = true;
     }
 
     Page *cache_page = &pc->pages[sid];
@@ -49,16 +126,37 @@ static bool _try_get_page(PageCache *pc, pageid_t pid, Page **page) {
     lru_register_entry(&pc->lru, sid);
     lru_access(&pc->lru, sid);
     cache_page->pins = 1;
+    atomic_store_explicit(&cache_page->referenced, false, memory_order_relaxed);
 
-    // Write old page if dirty
-    if (cache_page->dirty) {
+    // Write old page if dirty. Mapped pages are already in the file
+    if (cache_page->dirty && pc->buffer != NULL) {
         disk_write(&pc->dm, cache_page->pid, cache_page->data);
-        cache_page->dirty = false;
+        if (pc->tier != NULL) {
+            tier_remove(pc->tier, cache_page->pid);
+        }
+    }
+    cache_page->dirty = false;
+
+    // The old page is no longer cached, apart from in the second tier
+    if (evicted) {
+        _remove_cache_page(pc, cache_page->pid);
+        if (pc->tier != NULL) {
+            tier_put(pc->tier, cache_page->pid, cache_page->data);
+        }
     }
 
     // Read new page
+    page_write_begin(cache_page);
     cache_page->pid = pid;
-    disk_read(&pc->dm, cache_page->pid, cache_page->data);
+    if (pc->buffer != NULL) {
+        if (pc->tier == NULL ||
+            !tier_get(pc->tier, cache_page->pid, cache_page->data)) {
+            disk_read(&pc->dm, cache_page->pid, cache_page->data);
+        }
+    } else {
+        cache_page->data = disk_page(&pc->dm, cache_page->pid);
+    }
+    page_write_end(cache_page);
 
     // Insert pid -> sid into page table
     _insert_cache_page(pc, cache_page->pid, sid);
@@ -69,38 +167,347 @@ static bool _try_get_page(PageCache *pc, pageid_t pid, Page **page) {
 }
 
 void cache_init(char *path, PageCache *pc) {
-    disk_open(path, &pc->dm);
+    cache_init_slots(path, CACHE_SLOTS, pc);
+
+    return;
+}
+
+static void _cache_init(size_t slots, PageCache *pc) {
+    pc->slots = slots;
+    pthread_mutex_init(&pc->latch, NULL);
 
     lru_init(&pc->lru);
 
-    vec_init_PageSlot(&pc->ptable);
+    // At most half full
+    size_t ptable_size = 1;
+    while (ptable_size < 2 * slots) {
+        ptable_size *= 2;
+    }
+    pc->ptable = calloc(ptable_size, sizeof(PageSlot));
+    pc->ptable_mask = ptable_size - 1;
 
     vec_init_slotid_t(&pc->free);
-    for (slotid_t i = 0; i < CACHE_SLOTS; i++) {
+    for (slotid_t i = 0; i < slots; i++) {
         vec_push_slotid_t(&pc->free, i);
     }
 
-    pc->pages = calloc(CACHE_SLOTS, sizeof(Page));
+    pc->pages = calloc(slots, sizeof(Page));
 
     return;
 }
 
-bool cache_new_page(PageCache *pc, Page **page) {
+void cache_init_slots(char *path, size_t slots, PageCache *pc) {
+    disk_open(path, &pc->dm);
+    _cache_init(slots, pc);
+
+    pc->buffer = calloc(slots, PAGE_SIZE);
+    for (size_t i = 0; i < slots; i++) {
+        pc->pages[i].data = pc->buffer + i * PAGE_SIZE;
+    }
+
+    return;
+}
+
+void cache_init_mmap(char *path, size_t slots, PageCache *pc) {
+    disk_open_mmap(path, &pc->dm);
+    _cache_init(slots, pc);
+
+    pc->buffer = NULL;
+
+    return;
+}
+
+// The sidecar is a header followed by one entry per resident page
+#define CACHE_WARM_MAGIC 0x6d726177 /* "warm" */
+
+typedef struct WarmHeader WarmHeader;
+struct WarmHeader {
+    uint32_t magic;
+    uint32_t len;
+    unsigned int timestamp;
+};
+
+typedef struct WarmEntry WarmEntry;
+struct WarmEntry {
+    pageid_t pid;
+    LRUKHistory history;
+};
+
+static unsigned int _last_access(const LRUKHistory *history) {
+    return history->len == 0 ? 0 : history->timestamps[history->len - 1];
+}
+
+// Order entries by how long the LRU-K policy would keep them: entries with a
+// full history by backward K-distance, then the rest by their last access
+static int _cmp_warm_keep(const void *a, const void *b) {
+    const LRUKHistory *x = &((const WarmEntry *)a)->history;
+    const LRUKHistory *y = &((const WarmEntry *)b)->history;
+    bool x_full = x->len == LRUK + 1, y_full = y->len == LRUK + 1;
+    if (x_full != y_full) {
+        return y_full - x_full;
+    }
+
+    unsigned int xt = x_full ? x->timestamps[0] : _last_access(x);
+    unsigned int yt = y_full ? y->timestamps[0] : _last_access(y);
+    return (xt < yt) - (xt > yt);
+}
+
+static int _cmp_warm_pid(const void *a, const void *b) {
+    pageid_t x = ((const WarmEntry *)a)->pid;
+    pageid_t y = ((const WarmEntry *)b)->pid;
+    return (x > y) - (x < y);
+}
+
+// Read the sidecar, keeping the entries for pages that are still allocated.
+// Returns NULL if there is no usable sidecar
+static WarmEntry *_warm_read(PageCache *pc, size_t *len,
+                             unsigned int *timestamp) {
+    FILE *f = fopen(pc->warm_path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    WarmHeader header = {0};
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != CACHE_WARM_MAGIC) {
+        fclose(f);
+        return NULL;
+    }
+
+    // The length comes from the file, so it can't be trusted past what the
+    // file holds
+    struct stat st;
+    if (fstat(fileno(f), &st) == -1) {
+        fclose(f);
+        return NULL;
+    }
+    size_t max = ((size_t)st.st_size - sizeof(header)) / sizeof(WarmEntry);
+    if (header.len < max) {
+        max = header.len;
+    }
+
+    WarmEntry *entries = calloc(max + 1, sizeof(WarmEntry));
+    size_t n = fread(entries, sizeof(WarmEntry), max, f);
+    fclose(f);
+
+    // A page is only placed in one slot, so duplicates are dropped
+    qsort(entries, n, sizeof(WarmEntry), _cmp_warm_pid);
+    *len = 0;
+    for (size_t i = 0; i < n; i++) {
+        pageid_t pid = entries[i].pid;
+        if (pid > FREE_LIST_PAGE_ID && pid <= pc->dm.meta->next &&
+            !disk_is_free(&pc->dm, pid) &&
+            entries[i].history.len <= LRUK + 1 &&
+            (*len == 0 || entries[*len - 1].pid != pid)) {
+            entries[(*len)++] = entries[i];
+        }
+    }
+    *timestamp = header.timestamp;
+
+    return entries;
+}
+
+// Place the pages in slots 0 to len - 1, reading runs of nearby pids at once
+static void _warm_load(PageCache *pc, const WarmEntry *entries, size_t len) {
+    char *scratch = NULL;
+    if (pc->buffer != NULL) {
+        scratch = malloc(CACHE_WARM_BATCH * PAGE_SIZE);
+    }
+
+    for (size_t i = 0; i < len;) {
+        pageid_t first = entries[i].pid;
+        size_t j = i + 1;
+        while (j < len && entries[j].pid - first < CACHE_WARM_BATCH &&
+               entries[j].pid - entries[j - 1].pid <= CACHE_WARM_GAP) {
+            j++;
+        }
+
+        size_t n = entries[j - 1].pid - first + 1;
+        if (scratch != NULL) {
+            disk_read_pages(&pc->dm, first, n, scratch);
+        }
+
+        for (slotid_t sid = i; sid < j; sid++) {
+            Page *page = &pc->pages[sid];
+            page->pid = entries[sid].pid;
+            if (scratch != NULL) {
+                memcpy(page->data, scratch + (page->pid - first) * PAGE_SIZE,
+                       PAGE_SIZE);
+            } else {
+                page->data = disk_page(&pc->dm, page->pid);
+            }
+            _insert_cache_page(pc, page->pid, sid);
+
+            lru_register_entry(&pc->lru, sid);
+            lru_find_entry(&pc->lru, sid)->history = entries[sid].history;
+            lru_set_evictable(&pc->lru, sid, true);
+        }
+
+        i = j;
+    }
+
+    free(scratch);
+}
+
+static void *_cache_dumper(void *arg) {
+    PageCache *pc = arg;
+
+    pthread_mutex_lock(&pc->latch);
+    while (!pc->dumper_stop) {
+        struct timespec deadline;
+        timespec_get(&deadline, TIME_UTC);
+        deadline.tv_sec += pc->dump_interval_ms / 1000;
+        deadline.tv_nsec += (long)(pc->dump_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int err = 0;
+        while (!pc->dumper_stop && err == 0) {
+            err = pthread_cond_timedwait(&pc->dumper_cond, &pc->latch,
+                                         &deadline);
+        }
+        if (pc->dumper_stop) {
+            break;
+        }
+
+        // A failed dump leaves the previous one in place
+        pthread_mutex_unlock(&pc->latch);
+        cache_dump(pc);
+        pthread_mutex_lock(&pc->latch);
+    }
+    pthread_mutex_unlock(&pc->latch);
+
+    return NULL;
+}
+
+size_t cache_warm(PageCache *pc, char *path, unsigned int interval_ms) {
+    assert(pc->lru.entries.len == 0);
+
+    pc->warm_path = strdup(path);
+
+    size_t len = 0;
+    unsigned int timestamp = 0;
+    WarmEntry *entries = _warm_read(pc, &len, &timestamp);
+    if (entries != NULL) {
+        // Keep the pages that would be evicted last, then read them in the
+        // order they are in the file
+        if (len > pc->slots) {
+            qsort(entries, len, sizeof(WarmEntry), _cmp_warm_keep);
+            len = pc->slots;
+        }
+        qsort(entries, len, sizeof(WarmEntry), _cmp_warm_pid);
+
+        // Later accesses must be newer than any restored one
+        for (size_t i = 0; i < len; i++) {
+            unsigned int last = _last_access(&entries[i].history);
+            if (timestamp <= last) {
+                timestamp = last + 1;
+            }
+        }
+        pc->lru.timestamp = timestamp;
+
+        _warm_load(pc, entries, len);
+
+        // The slots from len up are still free
+        pc->free.len = 0;
+        for (slotid_t sid = len; sid < pc->slots; sid++) {
+            vec_push_slotid_t(&pc->free, sid);
+        }
+
+        free(entries);
+    }
+
+    if (interval_ms != 0) {
+        pc->dump_interval_ms = interval_ms;
+        pc->dumper_stop = false;
+        pthread_cond_init(&pc->dumper_cond, NULL);
+        int err = pthread_create(&pc->dumper, NULL, _cache_dumper, pc);
+        if (err != 0) {
+            printf("could not start dumper: %s\n", strerror(err));
+            exit(1);
+        }
+        pc->dumping = true;
+    }
+
+    return len;
+}
+
+bool cache_dump(PageCache *pc) {
+    if (pc->warm_path == NULL) {
+        return false;
+    }
+
+    // Copy the state under the latch and write it without
+    pthread_mutex_lock(&pc->latch);
+    WarmHeader header = {.magic = CACHE_WARM_MAGIC,
+                         .len = pc->lru.entries.len,
+                         .timestamp = pc->lru.timestamp};
+    WarmEntry *entries = calloc(header.len + 1, sizeof(WarmEntry));
+    for (size_t i = 0; i < header.len; i++) {
+        LRUEntry *entry = &pc->lru.entries.data[i];
+        entries[i] = (WarmEntry){.pid = pc->pages[entry->sid].pid,
+                                 .history = entry->history};
+    }
+    pthread_mutex_unlock(&pc->latch);
+
+    // Write a new file and rename it over the old one so a crash mid dump
+    // keeps the previous sidecar
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pc->warm_path);
+    FILE *f = fopen(tmp_path, "wb");
+    bool ok = f != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(entries, sizeof(WarmEntry), header.len, f) == header.len;
+        ok &= fclose(f) == 0;
+        ok = ok && rename(tmp_path, pc->warm_path) == 0;
+        if (!ok) {
+            remove(tmp_path);
+        }
+    }
+
+    free(entries);
+
+    return ok;
+}
+
+void cache_tier_init(PageCache *pc, size_t budget) {
+    assert(pc->buffer != NULL);
+
+    pc->tier = malloc(sizeof(Tier));
+    tier_init(pc->tier, budget);
+
+    return;
+}
+
+static bool _cache_new_page(PageCache *pc, Page **page) {
     pageid_t pid = disk_alloc(&pc->dm);
 
+    // The tier may still hold the page from before it was freed
+    if (pc->tier != NULL) {
+        tier_remove(pc->tier, pid);
+    }
+
+    // The pid came off the free list or the end of the file, so either has
+    // room to take it back
     if (!_try_get_page(pc, pid, page)) {
-        disk_free(&pc->dm, pid);
+        disk_free_run(&pc->dm, pid, 1);
         return false;
     }
 
     return true;
 }
 
-bool cache_fetch_page(PageCache *pc, pageid_t pid, Page **page) {
+static bool _cache_fetch_page(PageCache *pc, pageid_t pid, Page **page) {
     slotid_t sid = 0;
     if (_find_cache_page(pc, pid, &sid)) {
         *page = &pc->pages[sid];
-        (*page)->pins++;
+        if ((*page)->pins++ == 0) {
+            lru_set_evictable(&pc->lru, sid, false);
+        }
+        lru_access(&pc->lru, sid);
 
         return true;
     }
@@ -108,52 +515,217 @@ bool cache_fetch_page(PageCache *pc, pageid_t pid, Page **page) {
     return _try_get_page(pc, pid, page);
 }
 
+bool cache_new_page(PageCache *pc, Page **page) {
+    pthread_mutex_lock(&pc->latch);
+    bool ok = _cache_new_page(pc, page);
+    pthread_mutex_unlock(&pc->latch);
+
+    return ok;
+}
+
+bool cache_fetch_page(PageCache *pc, pageid_t pid, Page **page) {
+    pthread_mutex_lock(&pc->latch);
+    bool ok = _cache_fetch_page(pc, pid, page);
+    pthread_mutex_unlock(&pc->latch);
+
+    return ok;
+}
+
 bool cache_fetch_or_set(PageCache *pc, pageid_t *pid, Page **page) {
+    pthread_mutex_lock(&pc->latch);
+    bool ok = false;
     if (*pid == 0) {
-        if (!cache_new_page(pc, page)) {
-            return false;
+        ok = _cache_new_page(pc, page);
+        if (ok) {
+            *pid = (*page)->pid;
         }
-
-        *pid = (*page)->pid;
-        return true;
+    } else {
+        ok = _cache_fetch_page(pc, *pid, page);
     }
+    pthread_mutex_unlock(&pc->latch);
 
-    return cache_fetch_page(pc, *pid, page);
+    return ok;
 }
 
 void cache_unpin(PageCache *pc, Page *page) {
-    if (--page->pins != 0) {
-        return;
+    pthread_mutex_lock(&pc->latch);
+    if (--page->pins == 0) {
+        lru_set_evictable(&pc->lru, page - pc->pages, true);
     }
+    pthread_mutex_unlock(&pc->latch);
 
-    bool evictable = true;
-    slotid_t sid = 0;
-    _find_cache_page(pc, page->pid, &sid);
-    lru_set_evictable(&pc->lru, sid, evictable);
+    return;
+}
+
+static void _cache_flush_page(PageCache *pc, Page *page) {
+    if (pc->buffer != NULL) {
+        disk_write(&pc->dm, page->pid, page->data);
+
+        // The tier's copy may be older than what was written
+        if (pc->tier != NULL) {
+            tier_remove(pc->tier, page->pid);
+        }
+    } else {
+        disk_sync(&pc->dm, page->pid);
+    }
+    page->dirty = false;
 
     return;
 }
 
+// The write may allocate a shadow page for a snapshot, so it takes the latch
+// like any other allocation
 void cache_flush_page(PageCache *pc, Page *page) {
-    disk_write(&pc->dm, page->pid, page->data);
-    page->dirty = false;
+    pthread_mutex_lock(&pc->latch);
+    _cache_flush_page(pc, page);
+    pthread_mutex_unlock(&pc->latch);
 
     return;
 }
 
+// Like a flush, the write may allocate a shadow page
+void cache_write_pages(PageCache *pc, pageid_t pid, size_t n,
+                       const char *data) {
+    pthread_mutex_lock(&pc->latch);
+    disk_write_pages(&pc->dm, pid, n, data);
+    if (pc->tier != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            tier_remove(pc->tier, pid + i);
+        }
+    }
+    pthread_mutex_unlock(&pc->latch);
+
+    return;
+}
+
+bool cache_snapshot(PageCache *pc, DiskSnapshot *snapshot) {
+    pthread_mutex_lock(&pc->latch);
+    bool ok = pc->dm.snapshot == NULL && pc->dm.map == NULL;
+    if (ok) {
+        for (size_t i = 0; i < pc->slots; i++) {
+            if (pc->pages[i].dirty) {
+                _cache_flush_page(pc, &pc->pages[i]);
+            }
+        }
+
+        ok = disk_snapshot(&pc->dm, snapshot);
+    }
+    pthread_mutex_unlock(&pc->latch);
+
+    return ok;
+}
+
+void cache_snapshot_release(PageCache *pc, DiskSnapshot *snapshot) {
+    pthread_mutex_lock(&pc->latch);
+    disk_snapshot_release(snapshot);
+    pthread_mutex_unlock(&pc->latch);
+
+    return;
+}
+
+bool cache_peek_page(PageCache *pc, pageid_t pid, Page **page) {
+    slotid_t sid = 0;
+    if (!_find_cache_page(pc, pid, &sid)) {
+        return false;
+    }
+
+    *page = &pc->pages[sid];
+
+    // Only write the flag when it changes, to keep the frame's line shared
+    if (!atomic_load_explicit(&(*page)->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&(*page)->referenced, true,
+                              memory_order_relaxed);
+    }
+
+    return true;
+}
+
+bool cache_prefetch_page(PageCache *pc, pageid_t pid) {
+    slotid_t sid = 0;
+    if (!_find_cache_page(pc, pid, &sid)) {
+        // A prefetch of a mapped page that isn't in memory is dropped rather
+        // than faulting
+        if ((size_t)(pid + 1) * PAGE_SIZE <= pc->dm.map_len) {
+            __builtin_prefetch(pc->dm.map + (size_t)pid * PAGE_SIZE);
+        }
+        return false;
+    }
+
+    // The frame may be reused meanwhile, which only wastes the prefetch
+    Page *page = &pc->pages[sid];
+    __builtin_prefetch(page);
+    __builtin_prefetch(page->data);
+
+    return true;
+}
+
 void cache_close(PageCache *pc) {
+    if (pc->dumping) {
+        pthread_mutex_lock(&pc->latch);
+        pc->dumper_stop = true;
+        pthread_cond_signal(&pc->dumper_cond);
+        pthread_mutex_unlock(&pc->latch);
+
+        pthread_join(pc->dumper, NULL);
+        pthread_cond_destroy(&pc->dumper_cond);
+    }
+
+    for (size_t i = 0; i < pc->slots; i++) {
+        if (pc->pages[i].dirty) {
+            cache_flush_page(pc, &pc->pages[i]);
+        }
+    }
+
+    cache_dump(pc);
     disk_close(&pc->dm);
 
+    pthread_mutex_destroy(&pc->latch);
     free(pc->lru.entries.data);
-    free(pc->ptable.data);
+    free(pc->ptable);
     free(pc->free.data);
     free(pc->pages);
+    free(pc->buffer);
+    free(pc->warm_path);
+    if (pc->tier != NULL) {
+        tier_close(pc->tier);
+        free(pc->tier);
+    }
 
     *pc = (PageCache){0};
 
     return;
 }
 
+void page_write_begin(Page *page) {
+    atomic_fetch_add_explicit(&page->version, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    return;
+}
+
+void page_write_end(Page *page) {
+    atomic_fetch_add_explicit(&page->version, 1, memory_order_release);
+
+    return;
+}
+
+unsigned int page_read_begin(Page *page) {
+    unsigned int version = 0;
+    while ((version = atomic_load_explicit(&page->version,
+                                           memory_order_acquire)) &
+           1) {
+        sched_yield();
+    }
+
+    return version;
+}
+
+bool page_read_validate(Page *page, unsigned int version) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&page->version, memory_order_relaxed) ==
+           version;
+}
+
 void lru_init(LRU *lru) {
     vec_init_LRUEntry(&lru->entries);
 
@@ -194,24 +766,26 @@ void lru_access(LRU *lru, slotid_t sid) {
 
     LRUKHistory *history = &entry->history;
     if (history->len < LRUK + 1) {
-        history->timestamps[history->len++] = lru->timestamp;
+        history->timestamps[history->len++] = lru->timestamp++;
         return;
     }
 
     // Shift the array left one and assign the last element
-    memcpy(&history->timestamps[0], &history->timestamps[1], LRUK);
-    history->timestamps[LRUK] = lru->timestamp;
-    lru->timestamp++;
+    memmove(&history->timestamps[0], &history->timestamps[1],
+            LRUK * sizeof(history->timestamps[0]));
+    history->timestamps[LRUK] = lru->timestamp++;
 
     return;
 }
 
 bool lru_evict(LRU *lru, slotid_t *sid) {
-    int max = 0;
+    bool found = false;
+    unsigned int max = 0;
     slotid_t max_sid = 0;
 
     // For entries where we can't look back K accesses:
-    int oldest_lt_access = 0;
+    bool found_lt = false;
+    unsigned int oldest_lt_access = 0;
     slotid_t oldest_lt_sid = 0;
 
     for (size_t i = 0; i < lru->entries.len; i++) {
@@ -221,8 +795,10 @@ bool lru_evict(LRU *lru, slotid_t *sid) {
         }
 
         if (entry.history.len < LRUK + 1) {
-            int last_access = entry.history.timestamps[entry.history.len - 1];
-            if (oldest_lt_access == 0 || last_access < oldest_lt_access) {
+            unsigned int last_access =
+                entry.history.timestamps[entry.history.len - 1];
+            if (!found_lt || last_access < oldest_lt_access) {
+                found_lt = true;
                 oldest_lt_access = last_access;
                 oldest_lt_sid = entry.sid;
             }
@@ -230,21 +806,23 @@ bool lru_evict(LRU *lru, slotid_t *sid) {
             continue;
         }
 
-        int distance =
-            entry.history.timestamps[LRUK] - entry.history.timestamps[0];
-        if (distance > max) {
+        // Backward K-distance
+        unsigned int distance = lru->timestamp - entry.history.timestamps[0];
+        if (!found || distance > max) {
+            found = true;
             max = distance;
             max_sid = entry.sid;
         }
     }
 
-    if (max_sid != 0) {
-        *sid = max_sid;
+    // Entries with less than K accesses have an infinite backward K-distance
+    if (found_lt) {
+        *sid = oldest_lt_sid;
         return true;
     }
 
-    if (oldest_lt_sid != 0) {
-        *sid = oldest_lt_sid;
+    if (found) {
+        *sid = max_sid;
         return true;
     }
 
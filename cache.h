@@ -1,13 +1,23 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "disk.h"
+#include "tier.h"
 #include "vec.h"
 
 #define CACHE_SLOTS 256
 
+// The resident set is reloaded in reads of at most CACHE_WARM_BATCH pages.
+// Pids up to CACHE_WARM_GAP apart share a read, with the pages in between
+// read and dropped
+#define CACHE_WARM_BATCH 64
+#define CACHE_WARM_GAP 8
+
 typedef size_t slotid_t;
 VEC_DEC(slotid_t)
 
@@ -32,34 +42,73 @@ struct LRU {
     vec_LRUEntry entries;
 };
 
-typedef struct PageSlot PageSlot;
-struct PageSlot {
-    pageid_t pid;
-    slotid_t sid;
-};
-VEC_DEC(PageSlot)
+// Page table entries pack pid << 32 | sid. The meta page is never cached, so
+// 0 marks an empty entry
+typedef _Atomic uint64_t PageSlot;
 
 typedef struct Page Page;
 struct Page {
     pageid_t pid;
-    // TODO: lock
     int pins; // reference count
     bool dirty;
-    int __padding;
+    atomic_bool referenced; /* read without a pin since the last eviction */
+    atomic_uint version;    /* odd while the page is being written */
 
-    char data[PAGE_SIZE];
+    char *data; /* the slot's buffer, or the page in the mapping */
 };
 
+// The latch protects the page table, LRU, free list and pins. Page data isn't
+// covered by it: writers bracket their changes with page_write_begin/end and
+// readers validate against the page version. Pages can also be read without
+// the latch or a pin by finding them with cache_peek_page, as long as the read
+// is validated
 typedef struct PageCache PageCache;
 struct PageCache {
     DiskManager dm;
-    vec_PageSlot ptable;
+    size_t slots;
+    pthread_mutex_t latch;
+    PageSlot *ptable; /* open addressing, read without the latch */
+    size_t ptable_mask;
     LRU lru;
     vec_slotid_t free; // TODO: can be fixed size
     Page *pages;
+    char *buffer; /* page data of every slot, NULL in mmap mode */
+    Tier *tier;   /* compressed copies of evicted pages, NULL if off */
+
+    char *warm_path; /* sidecar the resident set is dumped to, or NULL */
+    bool dumping;    /* the dumper thread is running */
+    bool dumper_stop;
+    unsigned int dump_interval_ms;
+    pthread_t dumper;
+    pthread_cond_t dumper_cond; /* waited on with the latch */
 };
 
 void cache_init(char *, PageCache *);
+// Same as cache_init but with a pool of the given number of slots instead of
+// CACHE_SLOTS
+void cache_init_slots(char *, size_t, PageCache *);
+// Cache on top of a mapping of the file. Pages point straight into the
+// mapping, so a miss costs no read or copy and writes reach the file through
+// the mapping. The slots only bound the number of pages tracked at once.
+//
+// Mmap mode gives up page write atomicity. Pages are changed in place in a
+// shared mapping and the kernel can write one back at any time, not only on
+// cache_flush_page, so a crash in the middle of a change can leave a torn page
+// in the file. Frames written back with pwrite don't have this problem. Use
+// mmap mode for read-mostly maps, or ones that can be rebuilt after a crash
+void cache_init_mmap(char *, size_t, PageCache *);
+// Keep compressed copies of evicted pages in memory, within the given number
+// of bytes, and check them on a miss before reading the disk. Not available in
+// mmap mode, where the OS page cache plays that part
+void cache_tier_init(PageCache *, size_t);
+// Keep the resident set across restarts in the sidecar file. The pages listed
+// in it are read back in pid order with their LRU-K history, and the set is
+// dumped again on cache_close and, if the interval in milliseconds isn't 0,
+// periodically by a background thread. Must be called before any page is
+// used. Returns the number of pages reloaded
+size_t cache_warm(PageCache *, char *, unsigned int);
+// Write the resident set to the sidecar. Returns false if it can't be written
+bool cache_dump(PageCache *);
 // Allocate a new page and attempt to find a slot in the cache. Returns false if
 // there is no free or evictable page
 bool cache_new_page(PageCache *, Page **);
@@ -69,8 +118,35 @@ bool cache_fetch_page(PageCache *, pageid_t, Page **);
 bool cache_fetch_or_set(PageCache *, pageid_t *, Page **);
 void cache_unpin(PageCache *, Page *);
 void cache_flush_page(PageCache *, Page *);
+// Write n contiguous pages straight to the file, dropping any copies in the
+// tier. The pages must not be resident
+void cache_write_pages(PageCache *, pageid_t, size_t, const char *);
+// Write back the dirty pages and take a snapshot of the file, so the snapshot
+// holds every change made through the cache so far. Pages must not be written
+// while it is taken. Returns false if a snapshot is already taken or in mmap
+// mode
+bool cache_snapshot(PageCache *, DiskSnapshot *);
+void cache_snapshot_release(PageCache *, DiskSnapshot *);
+// Find the page's frame without pinning it or taking the latch. The frame can
+// be reused for another page at any time, so the caller must check its pid
+// within a validated read. A page table entry moved by a concurrent removal can
+// be missed, so returning false doesn't mean the page isn't cached and the
+// caller must fall back to fetching it
+bool cache_peek_page(PageCache *, pageid_t, Page **);
+// Prefetch a resident page into the CPU cache without waiting for it. Takes no
+// latch or pin. Returns false if the page isn't resident
+bool cache_prefetch_page(PageCache *, pageid_t);
+// Write back all dirty pages, dump the resident set if it is kept and close
+// the underlying disk
 void cache_close(PageCache *);
 
+void page_write_begin(Page *);
+void page_write_end(Page *);
+// Wait for any writer to finish and return the version to validate against
+unsigned int page_read_begin(Page *);
+// Returns true if the page hasn't been written since page_read_begin
+bool page_read_validate(Page *, unsigned int);
+
 void lru_init(LRU *);
 LRUEntry *lru_find_entry(const LRU *, slotid_t);
 void lru_register_entry(LRU *, slotid_t);
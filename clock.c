@@ -0,0 +1,131 @@
+#include <stdlib.h>
+
+#include "clock.h"
+
+enum { ENTRY_UNUSED, ENTRY_USED, ENTRY_REFERENCED };
+
+static size_t _index_home(const ClockIndex *ci, uint64_t hash) {
+    return ((hash ^ hash >> 32) * 0x9e3779b97f4a7c15 >> 32) & ci->index_mask;
+}
+
+// Returns the index position holding the key, or of the empty position that
+// ends its probe
+static size_t _index_probe(const ClockIndex *ci, uint64_t hash,
+                           const void *key, size_t klen) {
+    size_t i = _index_home(ci, hash);
+    for (; ci->index[i] != 0; i = (i + 1) & ci->index_mask) {
+        uint32_t e = ci->index[i] - 1;
+        if (ci->hashes[e] == hash &&
+            (ci->match == NULL || ci->match(ci->ctx, e, key, klen))) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+void clock_index_init(ClockIndex *ci, size_t capacity, ClockMatch match,
+                      void *ctx) {
+    *ci = (ClockIndex){.capacity = capacity, .match = match, .ctx = ctx};
+
+    ci->hashes = calloc(capacity, sizeof(uint64_t));
+    ci->states = calloc(capacity, sizeof(uint8_t));
+    ci->free = calloc(capacity, sizeof(uint32_t));
+    for (size_t i = 0; i < capacity; i++) {
+        ci->free[ci->free_len++] = capacity - 1 - i;
+    }
+
+    // Sized so the index is never more than half full, which keeps probes short
+    size_t index_size = 1;
+    while (index_size < 2 * capacity) {
+        index_size *= 2;
+    }
+    ci->index = calloc(index_size, sizeof(uint32_t));
+    ci->index_mask = index_size - 1;
+
+    return;
+}
+
+void clock_index_close(ClockIndex *ci) {
+    free(ci->hashes);
+    free(ci->states);
+    free(ci->free);
+    free(ci->index);
+
+    *ci = (ClockIndex){0};
+
+    return;
+}
+
+bool clock_index_find(const ClockIndex *ci, uint64_t hash, const void *key,
+                      size_t klen, uint32_t *entry) {
+    size_t i = _index_probe(ci, hash, key, klen);
+    if (ci->index[i] == 0) {
+        return false;
+    }
+
+    *entry = ci->index[i] - 1;
+    return true;
+}
+
+bool clock_index_insert(ClockIndex *ci, uint64_t hash, uint32_t *entry) {
+    if (ci->free_len == 0) {
+        return false;
+    }
+
+    uint32_t e = ci->free[--ci->free_len];
+    ci->hashes[e] = hash;
+    ci->states[e] = ENTRY_USED;
+
+    size_t i = _index_home(ci, hash);
+    while (ci->index[i] != 0) {
+        i = (i + 1) & ci->index_mask;
+    }
+    ci->index[i] = e + 1;
+
+    *entry = e;
+    return true;
+}
+
+// Unlink the entry by shifting later entries of its cluster back into the gap,
+// so no probe sequence is broken and no tombstones build up
+void clock_index_remove(ClockIndex *ci, uint32_t entry) {
+    size_t i = _index_home(ci, ci->hashes[entry]);
+    while (ci->index[i] != entry + 1) {
+        i = (i + 1) & ci->index_mask;
+    }
+
+    for (size_t j = (i + 1) & ci->index_mask; ci->index[j] != 0;
+         j = (j + 1) & ci->index_mask) {
+        size_t home = _index_home(ci, ci->hashes[ci->index[j] - 1]);
+        if (((j - home) & ci->index_mask) >= ((j - i) & ci->index_mask)) {
+            ci->index[i] = ci->index[j];
+            i = j;
+        }
+    }
+    ci->index[i] = 0;
+
+    ci->states[entry] = ENTRY_UNUSED;
+    ci->free[ci->free_len++] = entry;
+
+    return;
+}
+
+void clock_index_reference(ClockIndex *ci, uint32_t entry) {
+    ci->states[entry] = ENTRY_REFERENCED;
+}
+
+bool clock_index_victim(ClockIndex *ci, uint32_t *entry) {
+    if (ci->free_len == ci->capacity) {
+        return false;
+    }
+
+    for (;; ci->hand = (ci->hand + 1) % ci->capacity) {
+        if (ci->states[ci->hand] == ENTRY_REFERENCED) {
+            ci->states[ci->hand] = ENTRY_USED;
+        } else if (ci->states[ci->hand] == ENTRY_USED) {
+            *entry = ci->hand;
+            return true;
+        }
+    }
+}
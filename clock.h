@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An open addressing index over a fixed array of entries owned by the caller,
+// with a stack of the unused entries and a CLOCK hand to pick the next victim.
+// The index keeps each used entry's hash. Where the hash doesn't identify the
+// key on its own, match tells whether an entry holds the key. A hit sets the
+// entry's referenced bit, and the hand clears it instead of picking the entry
+// the next time it passes
+typedef bool (*ClockMatch)(void *, uint32_t, const void *, size_t);
+
+typedef struct ClockIndex ClockIndex;
+struct ClockIndex {
+    size_t capacity;
+    uint64_t *hashes;    /* by entry */
+    uint8_t *states;     /* by entry, see clock.c */
+    uint32_t *free;      /* stack of unused entries */
+    size_t free_len;
+    uint32_t *index;     /* entry + 1 by hash, 0 marks empty */
+    size_t index_mask;
+    size_t hand;
+    ClockMatch match;    /* NULL if equal hashes mean equal keys */
+    void *ctx;
+};
+
+void clock_index_init(ClockIndex *, size_t, ClockMatch, void *);
+void clock_index_close(ClockIndex *);
+// Find the entry holding the key with the given hash, without referencing it
+bool clock_index_find(const ClockIndex *, uint64_t, const void *, size_t,
+                      uint32_t *);
+// Take an unused entry for a key that isn't held. Returns false if there is
+// none, in which case a victim has to be removed first
+bool clock_index_insert(ClockIndex *, uint64_t, uint32_t *);
+void clock_index_remove(ClockIndex *, uint32_t);
+void clock_index_reference(ClockIndex *, uint32_t);
+// Advance the hand to an unreferenced entry, which the caller then removes.
+// Returns false if no entry is used
+bool clock_index_victim(ClockIndex *, uint32_t *);
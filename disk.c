@@ -1,9 +1,13 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -19,20 +23,23 @@ static bool _page_in_free_list(const FreeList *free_list, pageid_t pid) {
 }
 
 static void _disk_read(const DiskManager *dm, pageid_t pid, char *data) {
-    ssize_t nbyte = pread(dm->fd, data, PAGE_SIZE, pid * PAGE_SIZE);
+    ssize_t nbyte = pread(dm->fd, data, PAGE_SIZE, (off_t)pid * PAGE_SIZE);
     if (nbyte == -1) {
         printf("could not seek read page: %s\n", strerror(errno));
         exit(1);
     } else if (nbyte != PAGE_SIZE && nbyte != 0) {
         printf("did not read full page, read: %zd\n", nbyte);
         exit(1);
+    } else if (nbyte == 0) {
+        // Page is past the end of the file, it has never been written
+        memset(data, 0, PAGE_SIZE);
     }
 
     return;
 }
 
 static void _disk_write(const DiskManager *dm, pageid_t pid, const char *data) {
-    ssize_t nbyte = pwrite(dm->fd, data, PAGE_SIZE, pid * PAGE_SIZE);
+    ssize_t nbyte = pwrite(dm->fd, data, PAGE_SIZE, (off_t)pid * PAGE_SIZE);
     if (nbyte == -1) {
         printf("could not write page: %s\n", strerror(errno));
         exit(1);
@@ -44,8 +51,26 @@ static void _disk_write(const DiskManager *dm, pageid_t pid, const char *data) {
     return;
 }
 
+static void _disk_write_pages(int fd, pageid_t pid, size_t n,
+                              const char *data) {
+    size_t size = n * PAGE_SIZE;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t nbyte = pwrite(fd, data + written, size - written,
+                               (off_t)pid * PAGE_SIZE + written);
+        if (nbyte == -1) {
+            printf("could not write pages: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        written += nbyte;
+    }
+
+    return;
+}
+
 void disk_open(char *path, DiskManager *dm) {
-    dm->fd = open(path, O_RDWR | O_CREAT);
+    dm->fd = open(path, O_RDWR | O_CREAT, 0644);
     if (dm->fd == -1) {
         printf("could not open %s: %s", path, strerror(errno));
         exit(1);
@@ -60,10 +85,229 @@ void disk_open(char *path, DiskManager *dm) {
     dm->free = calloc(1, PAGE_SIZE);
     _disk_read(dm, FREE_LIST_PAGE_ID, (char *)dm->free);
 
+    dm->map = NULL;
+    dm->map_len = 0;
+    dm->preallocate = true;
+
+    return;
+}
+
+// Allocate the space of pages from to to, inclusive, without writing them.
+// Returns false if the filesystem can't do it, in which case the file grows as
+// pages are written
+static bool _disk_preallocate(const DiskManager *dm, pageid_t from,
+                              pageid_t to) {
+    off_t offset = (off_t)from * PAGE_SIZE;
+    off_t len = ((off_t)to - from + 1) * PAGE_SIZE;
+
+#if defined(__linux__)
+    return fallocate(dm->fd, 0, offset, len) == 0;
+#elif defined(__APPLE__)
+    // Space is allocated past the end of the file, so extend it afterwards
+    fstore_t store = {.fst_flags = F_ALLOCATECONTIG,
+                      .fst_posmode = F_PEOFPOSMODE,
+                      .fst_length = offset + len};
+    struct stat st;
+    if (fstat(dm->fd, &st) == -1) {
+        return false;
+    }
+    store.fst_length -= st.st_size;
+    if (store.fst_length > 0 && fcntl(dm->fd, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(dm->fd, F_PREALLOCATE, &store) == -1) {
+            return false;
+        }
+    }
+    return st.st_size >= offset + len || ftruncate(dm->fd, offset + len) == 0;
+#else
+    return posix_fallocate(dm->fd, offset, len) == 0;
+#endif
+}
+
+// Make sure the space up to pid is allocated, reserving the next extent if it
+// isn't
+static void _disk_reserve(DiskManager *dm, pageid_t pid) {
+    if (!dm->preallocate || pid <= dm->meta->reserved) {
+        return;
+    }
+
+    pageid_t extent = dm->meta->reserved / 4;
+    if (extent < DISK_EXTENT_MIN_PAGES) {
+        extent = DISK_EXTENT_MIN_PAGES;
+    } else if (extent > DISK_EXTENT_MAX_PAGES) {
+        extent = DISK_EXTENT_MAX_PAGES;
+    }
+
+    pageid_t from = dm->meta->reserved + 1;
+    if (from <= FREE_LIST_PAGE_ID) {
+        from = FREE_LIST_PAGE_ID + 1;
+    }
+    if (_disk_preallocate(dm, from, pid + extent)) {
+        dm->meta->reserved = pid + extent;
+    }
+
+    return;
+}
+
+// Give the space of the pages back to the filesystem. Reads of them return
+// zeros afterwards
+static void _disk_punch(const DiskManager *dm, pageid_t pid, size_t n) {
+    off_t offset = (off_t)pid * PAGE_SIZE;
+    off_t len = (off_t)n * PAGE_SIZE;
+
+    // Like preallocation, releasing space is best effort
+#if defined(__linux__)
+    fallocate(dm->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+#elif defined(__APPLE__) && defined(F_PUNCHHOLE)
+    fpunchhole_t punch = {.fp_offset = offset, .fp_length = len};
+    fcntl(dm->fd, F_PUNCHHOLE, &punch);
+#else
+    (void)dm;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+// Extend the mapping to cover len bytes of the file, growing the file if it is
+// shorter
+static void _disk_map(DiskManager *dm, size_t len) {
+    if (len > DISK_MMAP_RESERVE) {
+        printf("file is larger than the mmap reserve: %zu\n", len);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(dm->fd, &st) == -1) {
+        printf("could not stat file: %s\n", strerror(errno));
+        exit(1);
+    }
+    if ((size_t)st.st_size < len && ftruncate(dm->fd, len) == -1) {
+        printf("could not grow file: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    char *addr = mmap(dm->map + dm->map_len, len - dm->map_len,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, dm->fd,
+                      dm->map_len);
+    if (addr == MAP_FAILED) {
+        printf("could not map file: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    dm->map_len = len;
+
+    return;
+}
+
+// Shrink the mapping to len bytes. The rest goes back to the inaccessible
+// reservation before the file is cut, so a stale pointer past the end faults
+// instead of reaching a mapping of nothing, and growing again maps over it
+static void _disk_unmap(DiskManager *dm, size_t len) {
+    char *addr = mmap(dm->map + len, dm->map_len - len, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                      -1, 0);
+    if (addr == MAP_FAILED) {
+        printf("could not unmap file: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    dm->map_len = len;
+
+    return;
+}
+
+void disk_open_mmap(char *path, DiskManager *dm) {
+    disk_open(path, dm);
+
+    dm->map = mmap(NULL, DISK_MMAP_RESERVE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (dm->map == MAP_FAILED) {
+        printf("could not reserve mapping: %s\n", strerror(errno));
+        exit(1);
+    }
+    dm->map_len = 0;
+
+    size_t len = ((size_t)dm->meta->next + 1) * PAGE_SIZE;
+    _disk_map(dm, (len + DISK_MMAP_GROW - 1) / DISK_MMAP_GROW * DISK_MMAP_GROW);
+
+    return;
+}
+
+char *disk_page(DiskManager *dm, pageid_t pid) {
+    size_t end = ((size_t)pid + 1) * PAGE_SIZE;
+    if (end > dm->map_len) {
+        size_t len = dm->map_len * 2;
+        if (len < end) {
+            len = (end + DISK_MMAP_GROW - 1) / DISK_MMAP_GROW * DISK_MMAP_GROW;
+        }
+
+        _disk_map(dm, len);
+    }
+
+    return dm->map + (size_t)pid * PAGE_SIZE;
+}
+
+void disk_sync(const DiskManager *dm, pageid_t pid) {
+    // msync needs an address aligned to the system page size, which can be
+    // larger than a page
+    size_t align = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)pid * PAGE_SIZE / align * align;
+    size_t end = ((size_t)pid + 1) * PAGE_SIZE;
+    if (msync(dm->map + start, end - start, MS_SYNC) == -1) {
+        printf("could not sync page %d: %s\n", pid, strerror(errno));
+        exit(1);
+    }
+
+    return;
+}
+
+void disk_advise(const DiskManager *dm, DiskAdvice advice) {
+    if (dm->map == NULL) {
+        return;
+    }
+
+    int madv = MADV_NORMAL;
+    if (advice == DISK_ADVICE_RANDOM) {
+        madv = MADV_RANDOM;
+    } else if (advice == DISK_ADVICE_SEQUENTIAL) {
+        madv = MADV_SEQUENTIAL;
+    }
+
+    // Advice is only a hint, so failing to apply it isn't an error
+    madvise(dm->map, dm->map_len, madv);
+
+    return;
+}
+
+void disk_prefetch(const DiskManager *dm, pageid_t pid) {
+    // Like advice, prefetching is only a hint
+    if (dm->map != NULL) {
+        size_t align = sysconf(_SC_PAGESIZE);
+        size_t start = (size_t)pid * PAGE_SIZE / align * align;
+        size_t end = ((size_t)pid + 1) * PAGE_SIZE;
+        if (end <= dm->map_len) {
+            madvise(dm->map + start, end - start, MADV_WILLNEED);
+        }
+        return;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(dm->fd, (off_t)pid * PAGE_SIZE, PAGE_SIZE,
+                  POSIX_FADV_WILLNEED);
+#endif
+
     return;
 }
 
 void disk_close(DiskManager *dm) {
+    if (dm->map != NULL) {
+        if (msync(dm->map, dm->map_len, MS_SYNC) == -1) {
+            printf("could not sync mapping: %s\n", strerror(errno));
+            exit(1);
+        }
+        munmap(dm->map, DISK_MMAP_RESERVE);
+    }
+
     _disk_write(dm, DISK_META_PAGE_ID, (char *)dm->meta);
     _disk_write(dm, FREE_LIST_PAGE_ID, (char *)dm->free);
 
@@ -82,13 +326,22 @@ void disk_close(DiskManager *dm) {
 
 pageid_t disk_alloc(DiskManager *dm) {
     if (dm->free->len > 0) {
-        printf("%d\n", dm->free->len);
         return dm->free->pages[--dm->free->len];
     }
 
+    _disk_reserve(dm, dm->meta->next + 1);
+
     return ++dm->meta->next;
 }
 
+pageid_t disk_alloc_run(DiskManager *dm, size_t n) {
+    pageid_t pid = dm->meta->next + 1;
+    _disk_reserve(dm, dm->meta->next + n);
+    dm->meta->next += n;
+
+    return pid;
+}
+
 void disk_read(const DiskManager *dm, pageid_t pid, char *data) {
     if (_page_in_free_list(dm->free, pid)) {
         printf("attempt to read freed page %d\n", pid);
@@ -100,22 +353,302 @@ void disk_read(const DiskManager *dm, pageid_t pid, char *data) {
     return;
 }
 
-void disk_write(const DiskManager *dm, pageid_t pid, const char *data) {
+void disk_read_pages(const DiskManager *dm, pageid_t pid, size_t n,
+                     char *data) {
+    size_t size = n * PAGE_SIZE;
+    size_t read = 0;
+    while (read < size) {
+        ssize_t nbyte = pread(dm->fd, data + read, size - read,
+                              (off_t)pid * PAGE_SIZE + read);
+        if (nbyte == -1) {
+            printf("could not read pages: %s\n", strerror(errno));
+            exit(1);
+        } else if (nbyte == 0) {
+            // The rest is past the end of the file and has never been written
+            memset(data + read, 0, size - read);
+            break;
+        }
+
+        read += nbyte;
+    }
+
+    return;
+}
+
+// Copy a page in the snapshot to a shadow before it is first overwritten
+static void _disk_preserve(DiskManager *dm, pageid_t pid) {
+    DiskSnapshot *snapshot = dm->snapshot;
+    if (snapshot == NULL || pid > snapshot->next ||
+        atomic_load(&snapshot->shadows[pid]) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&snapshot->latch);
+    if (atomic_load(&snapshot->shadows[pid]) == 0) {
+        // Shadows go at the end of the file, which is kept past the snapshot
+        // while it is held, so a shadow never needs preserving itself
+        char data[PAGE_SIZE];
+        _disk_read(dm, pid, data);
+        pageid_t shadow = disk_alloc_run(dm, 1);
+        _disk_write(dm, shadow, data);
+        atomic_store(&snapshot->shadows[pid], shadow);
+    }
+    pthread_mutex_unlock(&snapshot->latch);
+
+    return;
+}
+
+void disk_write(DiskManager *dm, pageid_t pid, const char *data) {
     if (_page_in_free_list(dm->free, pid)) {
         printf("attempt to write freed page %d\n", pid);
         exit(1);
     }
 
+    _disk_preserve(dm, pid);
+
     _disk_write(dm, pid, data);
 
     return;
 }
 
-void disk_free(DiskManager *dm, pageid_t pid) {
+void disk_write_pages(DiskManager *dm, pageid_t pid, size_t n,
+                      const char *data) {
+    for (size_t i = 0; i < n; i++) {
+        if (_page_in_free_list(dm->free, pid + i)) {
+            printf("attempt to write freed page %zu\n", pid + i);
+            exit(1);
+        }
+
+        _disk_preserve(dm, pid + i);
+    }
+
+    _disk_write_pages(dm->fd, pid, n, data);
+
+    return;
+}
+
+bool disk_free(DiskManager *dm, pageid_t pid) {
+    if (dm->free->len == FREE_LIST_CAPACITY) {
+        return false;
+    }
+
     dm->free->pages[dm->free->len++] = pid;
 
     // TODO: clear the page?
     // TODO: check if a new page needs to be allocated to hold the freed pid
 
+    return true;
+}
+
+bool disk_is_free(const DiskManager *dm, pageid_t pid) {
+    return _page_in_free_list(dm->free, pid);
+}
+
+bool disk_free_run(DiskManager *dm, pageid_t pid, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+
+    // The end of the file doesn't need tracking, the pages are allocated again
+    // in order. Their space isn't punched, so they stay reserved for that.
+    // While a snapshot is held the end stays past it, since shadows are
+    // allocated there, so the part of the run in the snapshot is tracked
+    pageid_t floor = dm->snapshot != NULL ? dm->snapshot->next : 0;
+    size_t tail = 0;
+    if ((size_t)pid + n - 1 == dm->meta->next && dm->meta->next > floor) {
+        tail = pid > floor ? n : dm->meta->next - floor;
+    }
+
+    // Nothing is punched or freed unless the whole run fits
+    if (dm->free->len + n - tail > FREE_LIST_CAPACITY) {
+        return false;
+    }
+
+    dm->meta->next -= tail;
+    n -= tail;
+    if (n == 0) {
+        return true;
+    }
+
+    // A snapshot still reads the pages it holds from the file
+    bool in_snapshot = dm->snapshot != NULL && pid <= dm->snapshot->next;
+    if (n >= DISK_PUNCH_PAGES && !in_snapshot) {
+        _disk_punch(dm, pid, n);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        disk_free(dm, pid + i);
+    }
+
+    return true;
+}
+
+static int _cmp_pid(const void *a, const void *b) {
+    pageid_t x = *(const pageid_t *)a, y = *(const pageid_t *)b;
+    return (x > y) - (x < y);
+}
+
+void disk_truncate(DiskManager *dm) {
+    // Free pages at the end of the file are dropped from the free list. Once
+    // it is sorted they are the ones at its end. As in disk_free_run, the end
+    // isn't moved back into a snapshot
+    pageid_t floor = dm->snapshot != NULL ? dm->snapshot->next : 0;
+    qsort(dm->free->pages, dm->free->len, sizeof(pageid_t), _cmp_pid);
+    while (dm->free->len > 0 &&
+           dm->free->pages[dm->free->len - 1] == dm->meta->next &&
+           dm->meta->next > floor) {
+        dm->free->len--;
+        dm->meta->next--;
+    }
+
+    // A mapping can only end on a multiple of the growth size, so in mmap mode
+    // the file keeps the rest of that last chunk
+    size_t len = ((size_t)dm->meta->next + 1) * PAGE_SIZE;
+    if (dm->map != NULL) {
+        len = (len + DISK_MMAP_GROW - 1) / DISK_MMAP_GROW * DISK_MMAP_GROW;
+        if (dm->map_len > len) {
+            _disk_unmap(dm, len);
+        }
+    }
+
+    if (ftruncate(dm->fd, len) == -1) {
+        printf("could not truncate file: %s\n", strerror(errno));
+        exit(1);
+    }
+    dm->meta->reserved = len / PAGE_SIZE - 1;
+
+    return;
+}
+
+bool disk_snapshot(DiskManager *dm, DiskSnapshot *snapshot) {
+    if (dm->snapshot != NULL || dm->map != NULL) {
+        return false;
+    }
+
+    *snapshot = (DiskSnapshot){.dm = dm, .next = dm->meta->next};
+    snapshot->meta = malloc(PAGE_SIZE);
+    memcpy(snapshot->meta, dm->meta, PAGE_SIZE);
+    snapshot->free = malloc(PAGE_SIZE);
+    memcpy(snapshot->free, dm->free, PAGE_SIZE);
+    pthread_mutex_init(&snapshot->latch, NULL);
+
+    snapshot->shadows = calloc((size_t)snapshot->next + 1, sizeof(pageid_t));
+    for (unsigned int i = 0; i < dm->free->len; i++) {
+        atomic_init(&snapshot->shadows[dm->free->pages[i]], DISK_SNAPSHOT_FREE);
+    }
+
+    dm->snapshot = snapshot;
+
+    return true;
+}
+
+// Replace the pages of data, read from the file at pid, that were shadowed
+// while they were being read. The shadows are checked after the read, so a
+// page overwritten during it is always caught
+static void _disk_snapshot_fix(DiskSnapshot *snapshot, pageid_t pid, size_t n,
+                               char *data) {
+    for (size_t i = 0; i < n; i++) {
+        pageid_t shadow = atomic_load(&snapshot->shadows[pid + i]);
+        char *page = data + i * PAGE_SIZE;
+        if (shadow == DISK_SNAPSHOT_FREE) {
+            memset(page, 0, PAGE_SIZE);
+        } else if (shadow != 0) {
+            _disk_read(snapshot->dm, shadow, page);
+        }
+    }
+}
+
+void disk_snapshot_read(DiskSnapshot *snapshot, pageid_t pid, char *data) {
+    if (pid > snapshot->next) {
+        printf("page %d is not in the snapshot\n", pid);
+        exit(1);
+    }
+
+    if (pid == DISK_META_PAGE_ID) {
+        memcpy(data, snapshot->meta, PAGE_SIZE);
+        return;
+    } else if (pid == FREE_LIST_PAGE_ID) {
+        memcpy(data, snapshot->free, PAGE_SIZE);
+        return;
+    }
+
+    _disk_read(snapshot->dm, pid, data);
+    _disk_snapshot_fix(snapshot, pid, 1, data);
+
+    return;
+}
+
+void disk_snapshot_backup(DiskSnapshot *snapshot, char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("could not open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    // The backup is a store file of its own with the snapshot's meta and free
+    // list. It has no reserved space
+    DiskMeta *meta = calloc(1, PAGE_SIZE);
+    memcpy(meta, snapshot->meta, PAGE_SIZE);
+    meta->reserved = 0;
+    _disk_write_pages(fd, DISK_META_PAGE_ID, 1, (char *)meta);
+    _disk_write_pages(fd, FREE_LIST_PAGE_ID, 1, (char *)snapshot->free);
+    free(meta);
+
+    char *data = malloc(DISK_SNAPSHOT_BATCH * PAGE_SIZE);
+    for (size_t pid = FREE_LIST_PAGE_ID + 1; pid <= snapshot->next;
+         pid += DISK_SNAPSHOT_BATCH) {
+        size_t n = snapshot->next - pid + 1;
+        if (n > DISK_SNAPSHOT_BATCH) {
+            n = DISK_SNAPSHOT_BATCH;
+        }
+
+        disk_read_pages(snapshot->dm, pid, n, data);
+        _disk_snapshot_fix(snapshot, pid, n, data);
+        _disk_write_pages(fd, pid, n, data);
+    }
+    free(data);
+
+    if (fsync(fd) == -1 || close(fd) == -1) {
+        printf("could not write backup: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return;
+}
+
+void disk_snapshot_release(DiskSnapshot *snapshot) {
+    DiskManager *dm = snapshot->dm;
+    dm->snapshot = NULL;
+
+    // Free the shadows as runs, so the ones at the end of the file go back to
+    // the allocator instead of filling the free list. A run the free list
+    // can't hold stays allocated
+    size_t len = 0;
+    pageid_t *shadows = calloc((size_t)snapshot->next + 1, sizeof(pageid_t));
+    for (size_t pid = 0; pid <= snapshot->next; pid++) {
+        pageid_t shadow = atomic_load(&snapshot->shadows[pid]);
+        if (shadow != 0 && shadow != DISK_SNAPSHOT_FREE) {
+            shadows[len++] = shadow;
+        }
+    }
+    qsort(shadows, len, sizeof(pageid_t), _cmp_pid);
+
+    for (size_t i = len; i > 0;) {
+        size_t j = i - 1;
+        while (j > 0 && shadows[j - 1] + 1 == shadows[j]) {
+            j--;
+        }
+
+        disk_free_run(dm, shadows[j], i - j);
+        i = j;
+    }
+    free(shadows);
+
+    pthread_mutex_destroy(&snapshot->latch);
+    free((void *)snapshot->shadows);
+    free(snapshot->meta);
+    free(snapshot->free);
+    *snapshot = (DiskSnapshot){0};
+
     return;
 }
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #define PAGE_SIZE 4096
 typedef unsigned int pageid_t;
 
@@ -7,6 +12,7 @@ typedef unsigned int pageid_t;
 typedef struct DiskMeta DiskMeta;
 struct DiskMeta {
     pageid_t next;
+    pageid_t reserved; /* space is allocated in the file up to this page */
 };
 
 #define FREE_LIST_PAGE_ID 1
@@ -16,17 +22,106 @@ struct FreeList {
     unsigned int len;
     pageid_t pages[];
 };
+#define FREE_LIST_CAPACITY                                                     \
+    ((PAGE_SIZE - sizeof(FreeList)) / sizeof(pageid_t))
+
+// The file grows in extents allocated ahead of the pages that use them, so the
+// filesystem can lay it out contiguously and allocations don't wait on it. An
+// extent is a quarter of the file, within these bounds. Freed runs of at least
+// DISK_PUNCH_PAGES give their space back to the filesystem
+#define DISK_EXTENT_MIN_PAGES 256
+#define DISK_EXTENT_MAX_PAGES 16384
+#define DISK_PUNCH_PAGES 16
+
+// In mmap mode the file is mapped into a reserved range of address space that
+// the mapping grows into, so pointers into it stay valid as the file grows
+#define DISK_MMAP_RESERVE ((size_t)1 << 36)
+#define DISK_MMAP_GROW ((size_t)1 << 20)
+
+typedef enum {
+    DISK_ADVICE_NORMAL,
+    DISK_ADVICE_RANDOM,
+    DISK_ADVICE_SEQUENTIAL,
+} DiskAdvice;
 
 typedef struct DiskManager DiskManager;
+
+// A snapshot is the file as it was when the snapshot was taken. Pages aren't
+// copied up front: the first write of a page in the snapshot first copies what
+// is on disk into a shadow page at the end of the file, and reads of the
+// snapshot go to the shadow from then on. Shadows are published before the
+// page is overwritten, so readers take no lock and never hold up writers
+#define DISK_SNAPSHOT_FREE ((pageid_t)-1) /* page was free, not in snapshot */
+#define DISK_SNAPSHOT_BATCH 64            /* pages per read of a backup */
+
+typedef struct DiskSnapshot DiskSnapshot;
+struct DiskSnapshot {
+    DiskManager *dm;
+    pageid_t next; /* last page in the snapshot */
+    DiskMeta *meta;
+    FreeList *free;
+    _Atomic pageid_t *shadows; /* by pid: 0 until the page is written */
+    pthread_mutex_t latch;     /* serialises writers copying pages */
+};
+
 struct DiskManager {
     int fd;
     DiskMeta *meta;
     FreeList *free;
+    char *map;      /* file mapping in mmap mode, otherwise NULL */
+    size_t map_len; /* mapped bytes, never more than the file size */
+    bool preallocate; /* reserve extents ahead of the allocated pages */
+    DiskSnapshot *snapshot; /* the snapshot pages are preserved for */
 };
 
 void disk_open(char *, DiskManager *);
+// Open the file and map it. disk_read and disk_write still use the file, the
+// mapping is only reached through disk_page. Pages written through the mapping
+// can reach the file half written, see cache_init_mmap
+void disk_open_mmap(char *, DiskManager *);
 void disk_close(DiskManager *);
 pageid_t disk_alloc(DiskManager *);
+// Allocate n contiguous pages at the end of the file, skipping the free list.
+// Returns the first pid
+pageid_t disk_alloc_run(DiskManager *, size_t);
 void disk_read(const DiskManager *, pageid_t, char *);
-void disk_write(const DiskManager *, pageid_t, const char *);
-void disk_free(DiskManager *, pageid_t);
+// Read n contiguous pages starting at pid with a single read. Unlike disk_read
+// the range may include free pages
+void disk_read_pages(const DiskManager *, pageid_t, size_t, char *);
+void disk_write(DiskManager *, pageid_t, const char *);
+// Write n contiguous pages starting at pid with a single write
+void disk_write_pages(DiskManager *, pageid_t, size_t, const char *);
+// Returns false if the free list is full, in which case the page stays
+// allocated
+bool disk_free(DiskManager *, pageid_t);
+// Free n contiguous pages. A run at the end of the file is given back to the
+// allocator, any other run goes on the free list, and a long run has its space
+// released to the filesystem. Returns false without freeing or releasing any
+// of the run if the free list can't hold it
+bool disk_free_run(DiskManager *, pageid_t, size_t);
+// Shrink the file to the last allocated page, dropping the free pages at the
+// end and the reserved extent. Used once pages have been compacted
+void disk_truncate(DiskManager *);
+bool disk_is_free(const DiskManager *, pageid_t);
+// The page inside the mapping, growing the file and mapping to cover it
+char *disk_page(DiskManager *, pageid_t);
+// Write a mapped page back to the file
+void disk_sync(const DiskManager *, pageid_t);
+void disk_advise(const DiskManager *, DiskAdvice);
+
+// Take a snapshot of the pages on disk. Pages written in memory but not yet on
+// disk aren't in it, see cache_snapshot. Only one snapshot can be taken at a
+// time and none in mmap mode, where writes don't go through disk_write.
+// Returns false if one can't be taken
+bool disk_snapshot(DiskManager *, DiskSnapshot *);
+// Read a page as it was when the snapshot was taken. Free pages read as zeros.
+// Safe to call alongside writers
+void disk_snapshot_read(DiskSnapshot *, pageid_t, char *);
+// Write the snapshot to a new store file in pid order, reading the file in
+// runs of DISK_SNAPSHOT_BATCH pages
+void disk_snapshot_backup(DiskSnapshot *, char *);
+// Stop preserving pages and free the shadows. Must not run alongside
+// allocations or writes
+void disk_snapshot_release(DiskSnapshot *);
+// Start reading the page into the OS page cache without waiting for it
+void disk_prefetch(const DiskManager *, pageid_t);
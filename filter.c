@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "filter.h"
+
+#define FILTER_BITS (FILTER_SIZE * 8)
+
+// Double hashing (Kirsch & Mitzenmacher) with bits 32 to 47 and 12 to 31 of the
+// hash. The low bits are skipped since every key in a bucket shares them, and
+// the bits from 48 up are left to route keys between maps, see map.h
+static void _filter_probes(uint64_t hash, uint32_t *h1, uint32_t *h2) {
+    *h1 = (uint32_t)(hash >> 32) & 0xffff;
+    *h2 = ((uint32_t)(hash >> 12) & 0xfffff) | 1;
+}
+
+void filter_clear(Filter *filter) {
+    memset(filter->bits, 0, FILTER_SIZE);
+
+    return;
+}
+
+void filter_add(Filter *filter, uint64_t hash) {
+    uint32_t h1 = 0, h2 = 0;
+    _filter_probes(hash, &h1, &h2);
+
+    for (uint32_t i = 0; i < FILTER_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) % FILTER_BITS;
+        filter->bits[bit / 8] |= 1 << (bit % 8);
+    }
+
+    return;
+}
+
+bool filter_contains(const Filter *filter, uint64_t hash) {
+    uint32_t h1 = 0, h2 = 0;
+    _filter_probes(hash, &h1, &h2);
+
+    for (uint32_t i = 0; i < FILTER_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) % FILTER_BITS;
+        if (!(filter->bits[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
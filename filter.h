@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FILTER_SIZE 64 /* bytes */
+#define FILTER_HASHES 5
+
+// Bloom filter over the hashes of the keys in a bucket. The caller passes the
+// key hash rather than the key, so it must be well mixed in its high bits
+typedef struct Filter Filter;
+struct Filter {
+    uint8_t bits[FILTER_SIZE];
+};
+
+void filter_clear(Filter *);
+void filter_add(Filter *, uint64_t);
+// Returns false if the hash was definitely not added
+bool filter_contains(const Filter *, uint64_t);
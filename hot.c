@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hot.h"
+
+// Keys with the same map hash are told apart by their bytes
+static bool _hot_match(void *ctx, uint32_t e, const void *key, size_t klen) {
+    const HotEntry *entry = &((Hot *)ctx)->entries[e];
+    return entry->klen == klen && memcmp(entry->data, key, klen) == 0;
+}
+
+static void _hot_drop(Hot *hot, uint32_t e) {
+    HotEntry *entry = &hot->entries[e];
+    hot->used -= entry->klen + entry->vlen;
+    free(entry->data);
+    *entry = (HotEntry){0};
+
+    clock_index_remove(&hot->clock, e);
+}
+
+// Drop the entry the clock picks. Returns false if the cache is empty
+static bool _hot_evict(Hot *hot) {
+    uint32_t e = 0;
+    if (!clock_index_victim(&hot->clock, &e)) {
+        return false;
+    }
+
+    _hot_drop(hot, e);
+    hot->stats.evictions++;
+    return true;
+}
+
+void hot_init(Hot *hot, size_t budget) {
+    *hot = (Hot){.budget = budget};
+
+    size_t capacity = budget / HOT_ENTRY_BUDGET;
+    if (capacity == 0) {
+        capacity = 1;
+    }
+    hot->entries = calloc(capacity, sizeof(HotEntry));
+    clock_index_init(&hot->clock, capacity, _hot_match, hot);
+
+    return;
+}
+
+void hot_close(Hot *hot) {
+    for (size_t i = 0; i < hot->clock.capacity; i++) {
+        free(hot->entries[i].data);
+    }
+    free(hot->entries);
+    clock_index_close(&hot->clock);
+
+    *hot = (Hot){0};
+
+    return;
+}
+
+bool hot_get(Hot *hot, uint64_t hash, char *key, size_t klen, char **value,
+             size_t *vlen) {
+    uint32_t e = 0;
+    if (!clock_index_find(&hot->clock, hash, key, klen, &e)) {
+        hot->stats.misses++;
+        return false;
+    }
+
+    HotEntry *entry = &hot->entries[e];
+    clock_index_reference(&hot->clock, e);
+    *value = entry->data + entry->klen;
+    *vlen = entry->vlen;
+    hot->stats.hits++;
+
+    return true;
+}
+
+void hot_put(Hot *hot, uint64_t hash, char *key, size_t klen, char *value,
+             size_t vlen) {
+    uint32_t e = 0;
+    if (clock_index_find(&hot->clock, hash, key, klen, &e)) {
+        _hot_drop(hot, e);
+    }
+
+    size_t size = klen + vlen;
+    if (size > HOT_MAX_ENTRY || size > hot->budget) {
+        return;
+    }
+
+    while (hot->used + size > hot->budget ||
+           !clock_index_insert(&hot->clock, hash, &e)) {
+        if (!_hot_evict(hot)) {
+            return;
+        }
+    }
+
+    HotEntry *entry = &hot->entries[e];
+    *entry = (HotEntry){.klen = klen, .vlen = vlen, .data = malloc(size)};
+    memcpy(entry->data, key, klen);
+    memcpy(entry->data + klen, value, vlen);
+    hot->used += size;
+
+    hot->stats.puts++;
+
+    return;
+}
+
+void hot_update(Hot *hot, uint64_t hash, char *key, size_t klen, char *value,
+                size_t vlen) {
+    uint32_t e = 0;
+    if (!clock_index_find(&hot->clock, hash, key, klen, &e)) {
+        return;
+    }
+
+    HotEntry *entry = &hot->entries[e];
+    if (entry->vlen == vlen) {
+        memmove(entry->data + klen, value, vlen);
+    } else {
+        hot_put(hot, hash, key, klen, value, vlen);
+    }
+    hot->stats.updates++;
+
+    return;
+}
+
+void hot_remove(Hot *hot, uint64_t hash, char *key, size_t klen) {
+    uint32_t e = 0;
+    if (clock_index_find(&hot->clock, hash, key, klen, &e)) {
+        _hot_drop(hot, e);
+    }
+
+    return;
+}
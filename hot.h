@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+
+// A cache of key/value pairs in front of a map, within a memory budget, so a
+// hot key is answered with one probe of the index and no page pins. Entries
+// are found by the key's map hash and replaced with CLOCK through a
+// ClockIndex. A pair larger than HOT_MAX_ENTRY bytes isn't cached
+#define HOT_MAX_ENTRY 512
+#define HOT_ENTRY_BUDGET 64 /* bytes of budget per entry, bounds the count */
+
+typedef struct HotStats HotStats;
+struct HotStats {
+    size_t hits;
+    size_t misses;
+    size_t puts;
+    size_t updates; /* cached values replaced by writes */
+    size_t evictions;
+};
+
+typedef struct HotEntry HotEntry;
+struct HotEntry {
+    uint32_t klen;
+    uint32_t vlen;
+    char *data; /* key then value, NULL if the entry is unused */
+};
+
+typedef struct Hot Hot;
+struct Hot {
+    size_t budget;
+    size_t used; /* key and value bytes held */
+    HotEntry *entries;
+    ClockIndex clock; /* over the entries, by map hash */
+    HotStats stats;
+};
+
+// Initialise a cache holding up to the given number of bytes
+void hot_init(Hot *, size_t);
+void hot_close(Hot *);
+// The value points into the cache and is only valid until the next call into
+// it. Keys are passed with their map hash
+bool hot_get(Hot *, uint64_t, char *, size_t, char **, size_t *);
+// Cache the pair, replacing the value of a key that is already held
+void hot_put(Hot *, uint64_t, char *, size_t, char *, size_t);
+// Replace the value of a key if it is held, leaving other keys out
+void hot_update(Hot *, uint64_t, char *, size_t, char *, size_t);
+void hot_remove(Hot *, uint64_t, char *, size_t);
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_WILD_COPY 16
+
+static uint32_t _lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t _lz_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Length of the match at ip, comparing eight bytes at a time
+static size_t _lz_match_len(const unsigned char *ip,
+                            const unsigned char *match,
+                            const unsigned char *end) {
+    size_t len = LZ_MIN_MATCH;
+    while ((size_t)(end - ip) >= len + sizeof(uint64_t)) {
+        uint64_t diff = _lz_read64(ip + len) ^ _lz_read64(match + len);
+        if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return len + (__builtin_ctzll(diff) >> 3);
+#else
+            return len + (__builtin_clzll(diff) >> 3);
+#endif
+        }
+        len += sizeof(uint64_t);
+    }
+
+    while (ip + len < end && ip[len] == match[len]) {
+        len++;
+    }
+
+    return len;
+}
+
+static size_t _lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the part of a length that didn't fit in its token
+static bool _lz_put_len(unsigned char **op, const unsigned char *oend,
+                        size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op == oend) {
+            return false;
+        }
+        *(*op)++ = 255;
+    }
+
+    if (*op == oend) {
+        return false;
+    }
+    *(*op)++ = len;
+
+    return true;
+}
+
+static bool _lz_get_len(const unsigned char **ip, const unsigned char *iend,
+                        size_t *len) {
+    unsigned char b = 255;
+    while (b == 255) {
+        if (*ip == iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    }
+
+    return true;
+}
+
+// Write the literals from anchor and, if mlen isn't 0, the match after them
+static bool _lz_put_sequence(unsigned char **op, const unsigned char *oend,
+                             const unsigned char *anchor, size_t lit,
+                             size_t offset, size_t mlen) {
+    if (*op == oend) {
+        return false;
+    }
+
+    size_t mtoken = mlen == 0 ? 0 : mlen - LZ_MIN_MATCH;
+    unsigned char *token = (*op)++;
+    *token = (lit < 15 ? lit : 15) << 4 | (mtoken < 15 ? mtoken : 15);
+
+    if (lit >= 15 && !_lz_put_len(op, oend, lit - 15)) {
+        return false;
+    }
+    if ((size_t)(oend - *op) < lit) {
+        return false;
+    }
+    memcpy(*op, anchor, lit);
+    *op += lit;
+
+    if (mlen == 0) {
+        return true;
+    }
+
+    if (oend - *op < 2) {
+        return false;
+    }
+    *(*op)++ = offset & 0xff;
+    *(*op)++ = offset >> 8;
+
+    return mtoken < 15 || _lz_put_len(op, oend, mtoken - 15);
+}
+
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap) {
+    // Positions are stored plus one so 0 marks an empty entry
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *end = base + n;
+    unsigned char *op = (unsigned char *)dst;
+    const unsigned char *oend = op + cap;
+
+    while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t seq = _lz_read32(ip);
+        size_t h = _lz_hash(seq);
+        uint32_t candidate = table[h];
+        table[h] = ip - base + 1;
+
+        if (candidate == 0 || (size_t)(ip - base) - (candidate - 1) >
+                                  LZ_MAX_OFFSET) {
+            ip++;
+            continue;
+        }
+
+        const unsigned char *match = base + candidate - 1;
+        if (_lz_read32(match) != seq) {
+            ip++;
+            continue;
+        }
+
+        size_t mlen = _lz_match_len(ip, match, end);
+
+        if (!_lz_put_sequence(&op, oend, anchor, ip - anchor, ip - match,
+                              mlen)) {
+            return 0;
+        }
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if (!_lz_put_sequence(&op, oend, anchor, end - anchor, 0, 0)) {
+        return 0;
+    }
+
+    return op - (unsigned char *)dst;
+}
+
+bool lz_decompress(const char *src, size_t n, char *dst, size_t len) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    unsigned char *base = (unsigned char *)dst, *op = base, *oend = base + len;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !_lz_get_len(&ip, iend, &lit)) {
+            return false;
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) {
+            return false;
+        }
+
+        // Short runs are copied with a fixed size where both sides have room,
+        // writing past the run into bytes that are written again after it
+        if (lit <= LZ_WILD_COPY && (size_t)(iend - ip) >= LZ_WILD_COPY &&
+            (size_t)(oend - op) >= LZ_WILD_COPY) {
+            memcpy(op, ip, LZ_WILD_COPY);
+        } else {
+            memcpy(op, ip, lit);
+        }
+        ip += lit;
+        op += lit;
+
+        // The last sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && !_lz_get_len(&ip, iend, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - base) ||
+            (size_t)(oend - op) < mlen) {
+            return false;
+        }
+
+        if (offset >= LZ_WILD_COPY &&
+            (size_t)(oend - op) >= mlen + LZ_WILD_COPY) {
+            for (size_t i = 0; i < mlen; i += LZ_WILD_COPY) {
+                memcpy(op + i, op + i - offset, LZ_WILD_COPY);
+            }
+            op += mlen;
+            continue;
+        }
+
+        // A match can overlap the bytes it produces. Each copy doubles the
+        // distance it can copy from, since the output repeats every offset
+        // bytes
+        for (size_t dist = offset; mlen > 0; dist *= 2) {
+            size_t n = mlen < dist ? mlen : dist;
+            memcpy(op, op - dist, n);
+            op += n;
+            mlen -= n;
+        }
+    }
+
+    return op == oend;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A small LZ77 codec in the style of LZ4, fast enough to run on every page
+// eviction. The input is a sequence of literal runs each followed by a match
+// copied from up to 64 KiB back:
+//
+// token (literal length << 4 | match length - 4) | literals | offset (2 bytes,
+// little endian) | ...
+//
+// A length of 15 in the token continues in the following bytes, each adding up
+// to 255. The last sequence has literals only
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Compress n bytes into dst, which holds cap bytes. Returns the compressed size,
+// or 0 if it doesn't fit in cap
+size_t lz_compress(const char *, size_t, char *, size_t);
+// Decompress n bytes into dst, which must come out to exactly len bytes.
+// Returns false if the input is malformed
+bool lz_decompress(const char *, size_t, char *, size_t);
@@ -1,33 +1,86 @@
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cache.h"
 #include "map.h"
 
-static size_t hash(char *);
 static bool _strcmp(char *, char *, size_t);
 
+static_assert(sizeof(Directory) +
+                      (1 << DIRECTORY_MAX_DEPTH) * sizeof(pageid_t) <=
+                  PAGE_SIZE,
+              "directory does not fit in a page");
+
+#define ENTRY_HEADER_SIZE (2 * sizeof(size_t))
+#define BUCKET_CAPACITY (PAGE_SIZE - sizeof(Bucket))
+
 bool bucket_put(Bucket *bucket, char *key, size_t klen, char *value,
                 size_t vlen) {
     size_t size = 0;
+    char *data = bucket->data + bucket->size;
 
-    memcpy(bucket->data + size, &klen, sizeof(size_t));
+    memcpy(data + size, &klen, sizeof(size_t));
     size += sizeof(size_t);
-    memcpy(bucket->data + size, &vlen, sizeof(size_t));
+    memcpy(data + size, &vlen, sizeof(size_t));
     size += sizeof(size_t);
-    memcpy(bucket->data + size, key, klen);
+    memcpy(data + size, key, klen);
     size += klen;
-    memcpy(bucket->data + size, value, vlen);
+    memcpy(data + size, value, vlen);
     size += vlen;
 
     bucket->len++;
     bucket->size += size;
-    assert(bucket->size <= PAGE_SIZE);
+    assert(sizeof(Bucket) + bucket->size <= PAGE_SIZE);
 
     return true;
 }
 
+bool bucket_get(Bucket *bucket, char *key, size_t klen, char **value,
+                size_t *vlen) {
+    BucketIter iter = {0};
+    bucket_iter_init(bucket, &iter);
+    char *ikey = NULL, *ivalue = NULL;
+    size_t iklen = 0, ivlen = 0;
+    while (bucket_iter_next(&iter, &ikey, &iklen, &ivalue, &ivlen)) {
+        if (klen != iklen) {
+            continue;
+        }
+
+        if (_strcmp(key, ikey, klen)) {
+            *value = ivalue;
+            *vlen = ivlen;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool bucket_remove(Bucket *bucket, char *key, size_t klen) {
+    BucketIter iter = {0};
+    bucket_iter_init(bucket, &iter);
+    char *entry = iter.current;
+    char *ikey = NULL, *ivalue = NULL;
+    size_t iklen = 0, ivlen = 0;
+    while (bucket_iter_next(&iter, &ikey, &iklen, &ivalue, &ivlen)) {
+        if (klen == iklen && _strcmp(key, ikey, klen)) {
+            size_t size = iter.current - entry;
+            memmove(entry, iter.current, iter.rem_size);
+
+            bucket->len--;
+            bucket->size -= size;
+            return true;
+        }
+
+        entry = iter.current;
+    }
+
+    return false;
+}
+
 void bucket_iter_init(Bucket *bucket, BucketIter *iter) {
     iter->current = bucket->data;
     iter->rem_len = bucket->len;
@@ -60,19 +113,162 @@ bool bucket_iter_next(BucketIter *iter, char **key, size_t *klen, char **value,
     return true;
 }
 
-static size_t hash(char *str) {
-    size_t hash = 5381;
-    int c;
+// FNV-1a followed by the murmur3 finalizer. The directory is indexed by the low
+// bits of the hash, so they need to depend on every byte of the key
+size_t map_hash(char *str, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3;
+    }
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
 
     return hash;
 }
 
 void map_init(Map *map, PageCache *pc) {
-    map->pc = pc;
-    map->directory_pid = 0;
+    *map = (Map){.pc = pc, .directory_pid = 0, .optimistic = true};
+}
+
+void map_open(Map *map, PageCache *pc, pageid_t directory_pid) {
+    map_init(map, pc);
+    map->directory_pid = directory_pid;
+}
+
+void map_close(Map *map) {
+    for (size_t p = 0; p < DIRECTORY_FILTER_PAGES; p++) {
+        if (map->filter_pages[p] != NULL) {
+            cache_unpin(map->pc, map->filter_pages[p]);
+            map->filter_pages[p] = NULL;
+        }
+    }
+
+    if (map->hot != NULL) {
+        hot_close(map->hot);
+        free(map->hot);
+        map->hot = NULL;
+    }
+}
+
+void map_hot_init(Map *map, size_t budget) {
+    map->hot = malloc(sizeof(Hot));
+    hot_init(map->hot, budget);
+}
+
+// Pin the filter pages that cover the first n directory slots, allocating the
+// ones that don't exist yet
+static bool _pin_filters(Map *map, Page *directory_page, size_t n) {
+    Directory *directory = (Directory *)directory_page->data;
+
+    size_t pages = (n + FILTERS_PER_PAGE - 1) / FILTERS_PER_PAGE;
+    for (size_t p = 0; p < pages; p++) {
+        if (map->filter_pages[p] != NULL) {
+            continue;
+        }
+
+        Page *page = NULL;
+        if (directory->filters[p] != 0) {
+            if (!cache_fetch_page(map->pc, directory->filters[p], &page)) {
+                return false;
+            }
+
+            map->filter_pages[p] = page;
+            continue;
+        }
+
+        page_write_begin(directory_page);
+        bool ok = cache_fetch_or_set(map->pc, &directory->filters[p], &page);
+        directory_page->dirty = true;
+        page_write_end(directory_page);
+        if (!ok) {
+            return false;
+        }
+
+        page_write_begin(page);
+        memset(page->data, 0, PAGE_SIZE);
+        page->dirty = true;
+        page_write_end(page);
+
+        map->filter_pages[p] = page;
+    }
+
+    return true;
+}
+
+static Filter *_slot_filter(Map *map, size_t i) {
+    Page *page = map->filter_pages[i / FILTERS_PER_PAGE];
+    return &((Filter *)page->data)[i % FILTERS_PER_PAGE];
+}
+
+// What the filter of a slot says about a hash. A filter that can't be pinned
+// says nothing, so the bucket has to be read
+typedef enum {
+    FILTER_ABSENT,
+    FILTER_MAYBE,
+    FILTER_UNPINNED,
+} FilterCheck;
+
+static FilterCheck _filter_contains(Map *map, Directory *directory, size_t i,
+                                    size_t h) {
+    size_t p = i / FILTERS_PER_PAGE;
+    if (map->filter_pages[p] == NULL) {
+        if (directory->filters[p] == 0 ||
+            !cache_fetch_page(map->pc, directory->filters[p],
+                              &map->filter_pages[p])) {
+            return FILTER_UNPINNED;
+        }
+    }
+
+    return filter_contains(_slot_filter(map, i), h) ? FILTER_MAYBE
+                                                    : FILTER_ABSENT;
+}
+
+// Count a lookup that read the bucket and didn't find the key
+static void _count_miss(Map *map, FilterCheck check) {
+    if (check == FILTER_MAYBE) {
+        map->stats.filter_false_positives++;
+    } else {
+        map->stats.filter_unpinned++;
+    }
+}
+
+// Apply to every directory slot that points to the bucket at local depth ld
+// holding hash h
+#define FOR_BUCKET_SLOTS(j, directory, ld, h)                                  \
+    for (size_t j = (h) & (((size_t)1 << (ld)) - 1);                           \
+         j < ((size_t)1 << (directory)->global_depth);                         \
+         j += ((size_t)1 << (ld)))
+
+static void _add_bucket_filter(Map *map, Directory *directory, size_t ld,
+                               size_t h) {
+    FOR_BUCKET_SLOTS(j, directory, ld, h) {
+        Page *page = map->filter_pages[j / FILTERS_PER_PAGE];
+        page_write_begin(page);
+        filter_add(_slot_filter(map, j), h);
+        page->dirty = true;
+        page_write_end(page);
+    }
+}
+
+static void _set_slot_filter(Map *map, size_t i, const Filter *filter) {
+    Page *page = map->filter_pages[i / FILTERS_PER_PAGE];
+    page_write_begin(page);
+    *_slot_filter(map, i) = *filter;
+    page->dirty = true;
+    page_write_end(page);
+}
+
+static void _set_bucket_filter(Map *map, Directory *directory, size_t ld,
+                               size_t h, const Filter *filter) {
+    FOR_BUCKET_SLOTS(j, directory, ld, h) {
+        _set_slot_filter(map, j, filter);
+    }
 }
 
 bool map_get(Map *map, char *key, size_t klen, char **value, size_t *vlen) {
@@ -80,42 +276,371 @@ bool map_get(Map *map, char *key, size_t klen, char **value, size_t *vlen) {
         return false;
     }
 
+    size_t h = map_hash(key, klen);
+    if (map->hot != NULL && hot_get(map->hot, h, key, klen, value, vlen)) {
+        return true;
+    }
+
     Page *directory_page = NULL;
     if (!cache_fetch_page(map->pc, map->directory_pid, &directory_page)) {
         return false;
     };
     Directory *directory = (Directory *)directory_page->data;
 
-    size_t i = hash(key) & ((1 << directory->global_depth) - 1);
-    if (directory->buckets[i] == 0) {
+    size_t i = h & ((1 << directory->global_depth) - 1);
+    pageid_t bucket_pid = directory->buckets[i];
+    FilterCheck check = bucket_pid != 0
+                            ? _filter_contains(map, directory, i, h)
+                            : FILTER_ABSENT;
+    cache_unpin(map->pc, directory_page);
+    if (bucket_pid == 0) {
+        return false;
+    }
+
+    if (check == FILTER_ABSENT) {
+        map->stats.filter_negatives++;
         return false;
     }
 
     Page *bucket_page = NULL;
-    if (!cache_fetch_page(map->pc, directory->buckets[i], &bucket_page)) {
+    if (!cache_fetch_page(map->pc, bucket_pid, &bucket_page)) {
         return false;
     }
     Bucket *bucket = (Bucket *)bucket_page->data;
 
-    BucketIter iter = {0};
-    bucket_iter_init(bucket, &iter);
-    char *ikey = NULL, *ivalue = NULL;
-    size_t iklen = 0, ivlen = 0;
-    while (bucket_iter_next(&iter, &ikey, &iklen, &ivalue, &ivlen)) {
-        if (klen != iklen) {
-            continue;
+    bool found = bucket_get(bucket, key, klen, value, vlen);
+    cache_unpin(map->pc, bucket_page);
+    if (!found) {
+        _count_miss(map, check);
+    } else if (map->hot != NULL) {
+        hot_put(map->hot, h, key, klen, *value, *vlen);
+    }
+
+    return found;
+}
+
+bool map_delete(Map *map, char *key, size_t klen) {
+    if (map->directory_pid == 0) {
+        return false;
+    }
+
+    size_t h = map_hash(key, klen);
+    if (map->hot != NULL) {
+        hot_remove(map->hot, h, key, klen);
+    }
+
+    Page *directory_page = NULL;
+    if (!cache_fetch_page(map->pc, map->directory_pid, &directory_page)) {
+        return false;
+    };
+    Directory *directory = (Directory *)directory_page->data;
+
+    // The filters keep the key's bits, a later lookup reads the bucket
+    size_t i = h & ((1 << directory->global_depth) - 1);
+    pageid_t bucket_pid = directory->buckets[i];
+    bool maybe = bucket_pid != 0 &&
+                 _filter_contains(map, directory, i, h) != FILTER_ABSENT;
+    cache_unpin(map->pc, directory_page);
+    if (!maybe) {
+        return false;
+    }
+
+    Page *bucket_page = NULL;
+    if (!cache_fetch_page(map->pc, bucket_pid, &bucket_page)) {
+        return false;
+    }
+
+    page_write_begin(bucket_page);
+    bool removed = bucket_remove((Bucket *)bucket_page->data, key, klen);
+    if (removed) {
+        bucket_page->dirty = true;
+    }
+    page_write_end(bucket_page);
+    cache_unpin(map->pc, bucket_page);
+
+    return removed;
+}
+
+// Like bucket_get, but for a page that may be written while it is read: every
+// length is bounds checked and the value is copied out. A value longer than
+// *vlen isn't copied and *vlen is set to its length. The result only means
+// something if the read is validated afterwards
+static bool _bucket_read(const char *data, char *key, size_t klen, char *value,
+                         size_t *vlen) {
+    Bucket bucket;
+    memcpy(&bucket, data, sizeof(Bucket));
+    if (bucket.size > BUCKET_CAPACITY) {
+        return false;
+    }
+
+    const char *current = data + sizeof(Bucket);
+    const char *end = current + bucket.size;
+    for (size_t n = 0; n < bucket.len; n++) {
+        if ((size_t)(end - current) < ENTRY_HEADER_SIZE) {
+            return false;
         }
 
-        if (_strcmp(key, ikey, klen)) {
-            *value = ivalue;
+        size_t iklen = 0, ivlen = 0;
+        memcpy(&iklen, current, sizeof(size_t));
+        memcpy(&ivlen, current + sizeof(size_t), sizeof(size_t));
+        current += ENTRY_HEADER_SIZE;
+
+        size_t rem = end - current;
+        if (iklen > rem || ivlen > rem - iklen) {
+            return false;
+        }
+
+        if (iklen == klen && memcmp(current, key, klen) == 0) {
+            if (ivlen > *vlen) {
+                *vlen = ivlen;
+                return false;
+            }
+
+            memcpy(value, current + iklen, ivlen);
             *vlen = ivlen;
             return true;
         }
+
+        current += iklen + ivlen;
+    }
+
+    return false;
+}
+
+// Start a validated read of a page, straight from its frame if it is resident
+// and optimistic reads are on, otherwise through a pin
+static bool _read_begin(Map *map, pageid_t pid, Page **page,
+                        unsigned int *version, bool *pinned) {
+    if (map->optimistic && cache_peek_page(map->pc, pid, page)) {
+        *version = page_read_begin(*page);
+        *pinned = false;
+        return true;
+    }
+
+    if (!cache_fetch_page(map->pc, pid, page)) {
+        return false;
+    }
+
+    *version = page_read_begin(*page);
+    *pinned = true;
+    return true;
+}
+
+static void _read_end(Map *map, Page *page, bool pinned) {
+    if (pinned) {
+        cache_unpin(map->pc, page);
+    }
+}
+
+// Run the next step of the lookup. Returns false once it is done
+static bool _lookup_step(Map *map, Directory *directory, MapLookup *lookup) {
+    switch (lookup->state) {
+    case LOOKUP_START: {
+        lookup->hash = map_hash(lookup->key, lookup->klen);
+        lookup->slot = lookup->hash & ((1 << directory->global_depth) - 1);
+        __builtin_prefetch(&directory->buckets[lookup->slot]);
+        if (map->filter_pages[lookup->slot / FILTERS_PER_PAGE] != NULL) {
+            __builtin_prefetch(_slot_filter(map, lookup->slot));
+        }
+
+        lookup->state = LOOKUP_SLOT;
+        return true;
+    }
+    case LOOKUP_SLOT: {
+        lookup->bucket_pid = directory->buckets[lookup->slot];
+        if (lookup->bucket_pid == 0) {
+            break;
+        }
+
+        FilterCheck check =
+            _filter_contains(map, directory, lookup->slot, lookup->hash);
+        if (check == FILTER_ABSENT) {
+            map->stats.filter_negatives++;
+            break;
+        }
+        lookup->filtered = check == FILTER_MAYBE;
+
+        if (!cache_prefetch_page(map->pc, lookup->bucket_pid) &&
+            map->readahead) {
+            disk_prefetch(&map->pc->dm, lookup->bucket_pid);
+        }
+        lookup->state = LOOKUP_BUCKET;
+        return true;
+    }
+    case LOOKUP_BUCKET: {
+        // A resident bucket is read from its frame without the latch or a
+        // pin, as in map_read, so the lookups in flight don't queue on the
+        // pool latch. Only a bucket that isn't found that way is pinned
+        bool found = false, valid = false;
+        size_t vlen = 0;
+        while (!valid) {
+            Page *bucket_page = NULL;
+            unsigned int version = 0;
+            bool pinned = false;
+            if (!_read_begin(map, lookup->bucket_pid, &bucket_page, &version,
+                             &pinned)) {
+                break;
+            }
+
+            vlen = lookup->vlen;
+            found = _bucket_read(bucket_page->data, lookup->key, lookup->klen,
+                                 lookup->value, &vlen);
+            valid = bucket_page->pid == lookup->bucket_pid &&
+                    page_read_validate(bucket_page, version);
+            _read_end(map, bucket_page, pinned);
+        }
+        if (!valid) {
+            break;
+        }
+
+        if (found) {
+            lookup->vlen = vlen;
+            lookup->found = true;
+        } else if (vlen <= lookup->vlen) {
+            _count_miss(map, lookup->filtered ? FILTER_MAYBE : FILTER_UNPINNED);
+        }
+        break;
+    }
+    case LOOKUP_DONE:
+        break;
     }
 
+    lookup->state = LOOKUP_DONE;
     return false;
 }
 
+size_t map_get_batch(Map *map, MapLookup *lookups, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        lookups[i].found = false;
+        lookups[i].state = LOOKUP_START;
+    }
+
+    Page *directory_page = NULL;
+    if (map->directory_pid == 0 ||
+        !cache_fetch_page(map->pc, map->directory_pid, &directory_page)) {
+        return 0;
+    }
+    Directory *directory = (Directory *)directory_page->data;
+
+    // Step through the lookups in flight round robin. When one finishes the
+    // next waiting lookup takes its place
+    size_t group[MAP_LOOKUP_GROUP];
+    size_t active = 0, next = 0, found = 0;
+    while (active < MAP_LOOKUP_GROUP && next < n) {
+        group[active++] = next++;
+    }
+
+    while (active > 0) {
+        for (size_t g = 0; g < active;) {
+            MapLookup *lookup = &lookups[group[g]];
+            if (_lookup_step(map, directory, lookup)) {
+                g++;
+                continue;
+            }
+
+            found += lookup->found;
+            if (next < n) {
+                group[g++] = next++;
+            } else {
+                group[g] = group[--active];
+            }
+        }
+    }
+
+    cache_unpin(map->pc, directory_page);
+
+    return found;
+}
+
+typedef enum { READ_MISS, READ_FOUND, READ_RETRY } ReadResult;
+
+static ReadResult _map_read(Map *map, char *key, size_t klen, size_t h,
+                            char *value, size_t *vlen) {
+    pageid_t directory_pid = map->directory_pid;
+    if (directory_pid == 0) {
+        return READ_MISS;
+    }
+
+    Page *directory_page = NULL;
+    unsigned int directory_version = 0;
+    bool directory_pinned = false;
+    if (!_read_begin(map, directory_pid, &directory_page, &directory_version,
+                     &directory_pinned)) {
+        return READ_MISS;
+    }
+    Directory *directory = (Directory *)directory_page->data;
+
+    // The depth may be torn, so keep the index in bounds until it's validated
+    size_t global_depth = directory->global_depth;
+    size_t i = 0;
+    if (global_depth <= DIRECTORY_MAX_DEPTH) {
+        i = h & ((1 << global_depth) - 1);
+    }
+    pageid_t bucket_pid = directory->buckets[i];
+    pageid_t filter_pid = directory->filters[i / FILTERS_PER_PAGE];
+
+    // The filter pages are pinned by the writer, so they are always resident
+    bool maybe = true;
+    Page *filter_page = NULL;
+    if (filter_pid != 0 && cache_peek_page(map->pc, filter_pid, &filter_page)) {
+        unsigned int filter_version = page_read_begin(filter_page);
+        Filter *filter =
+            &((Filter *)filter_page->data)[i % FILTERS_PER_PAGE];
+        maybe = filter_page->pid != filter_pid || filter_contains(filter, h);
+        maybe |= !page_read_validate(filter_page, filter_version);
+    }
+
+    if (directory_page->pid != directory_pid ||
+        global_depth > DIRECTORY_MAX_DEPTH ||
+        !page_read_validate(directory_page, directory_version)) {
+        _read_end(map, directory_page, directory_pinned);
+        return READ_RETRY;
+    }
+
+    if (bucket_pid == 0 || !maybe) {
+        _read_end(map, directory_page, directory_pinned);
+        return READ_MISS;
+    }
+
+    Page *bucket_page = NULL;
+    unsigned int bucket_version = 0;
+    bool bucket_pinned = false;
+    if (!_read_begin(map, bucket_pid, &bucket_page, &bucket_version,
+                     &bucket_pinned)) {
+        _read_end(map, directory_page, directory_pinned);
+        return READ_MISS;
+    }
+
+    bool found = _bucket_read(bucket_page->data, key, klen, value, vlen);
+
+    // The directory is written while a bucket splits, so it is validated
+    // again to make sure the key didn't move
+    bool valid = bucket_page->pid == bucket_pid &&
+                 page_read_validate(bucket_page, bucket_version) &&
+                 page_read_validate(directory_page, directory_version);
+    _read_end(map, bucket_page, bucket_pinned);
+    _read_end(map, directory_page, directory_pinned);
+
+    if (!valid) {
+        return READ_RETRY;
+    }
+
+    return found ? READ_FOUND : READ_MISS;
+}
+
+bool map_read(Map *map, char *key, size_t klen, char *value, size_t *vlen) {
+    size_t h = map_hash(key, klen);
+    size_t cap = *vlen;
+
+    ReadResult result = READ_RETRY;
+    while ((result = _map_read(map, key, klen, h, value, vlen)) ==
+           READ_RETRY) {
+        *vlen = cap;
+    }
+
+    return result == READ_FOUND;
+}
+
 static bool _strcmp(char *s1, char *s2, size_t slen) {
     size_t i;
     for (i = 0; i < slen && s1[i] == s2[i]; i++) {
@@ -124,85 +649,411 @@ static bool _strcmp(char *s1, char *s2, size_t slen) {
     return i == slen;
 }
 
+// Split the bucket that the hash maps to, doubling the directory if the bucket
+// is already at the global depth. The bucket page keeps the entries without the
+// new high bit and a new page takes the rest
+static bool _split_bucket(Map *map, Page *directory_page, Page *bucket_page,
+                          size_t h) {
+    Directory *directory = (Directory *)directory_page->data;
+    Bucket *bucket = (Bucket *)bucket_page->data;
+
+    bool doubling = bucket->local_depth == directory->global_depth;
+    size_t n = 1 << directory->global_depth;
+    if (doubling) {
+        if (directory->global_depth == DIRECTORY_MAX_DEPTH) {
+            return false;
+        }
+
+        if (!_pin_filters(map, directory_page, 2 * n)) {
+            return false;
+        }
+    }
+
+    Page *new_page = NULL;
+    if (!cache_new_page(map->pc, &new_page)) {
+        return false;
+    };
+
+    // The caller is already writing the bucket page
+    page_write_begin(directory_page);
+    page_write_begin(new_page);
+
+    if (doubling) {
+        memcpy(&directory->buckets[n], &directory->buckets[0],
+               n * sizeof(pageid_t));
+        for (size_t i = 0; i < n; i++) {
+            _set_slot_filter(map, n + i, _slot_filter(map, i));
+        }
+        directory->global_depth++;
+    }
+
+    char old_data[PAGE_SIZE];
+    memcpy(old_data, bucket_page->data, PAGE_SIZE);
+    Bucket *old_bucket = (Bucket *)old_data;
+
+    Bucket *bucket0 = (Bucket *)bucket_page->data;
+    Bucket *bucket1 = (Bucket *)new_page->data;
+    *bucket0 = (Bucket){.local_depth = old_bucket->local_depth + 1};
+    *bucket1 = (Bucket){.local_depth = old_bucket->local_depth + 1};
+
+    // split entries between the buckets, rebuilding their filters
+    size_t high_bit = 1 << old_bucket->local_depth;
+    Filter filter0 = {0}, filter1 = {0};
+    BucketIter iter = {0};
+    bucket_iter_init(old_bucket, &iter);
+    char *ikey = NULL, *ivalue = NULL;
+    size_t iklen = 0, ivlen = 0;
+    while (bucket_iter_next(&iter, &ikey, &iklen, &ivalue, &ivlen)) {
+        size_t ih = map_hash(ikey, iklen);
+        if (ih & high_bit) {
+            bucket_put(bucket1, ikey, iklen, ivalue, ivlen);
+            filter_add(&filter1, ih);
+        } else {
+            bucket_put(bucket0, ikey, iklen, ivalue, ivlen);
+            filter_add(&filter0, ih);
+        }
+    }
+
+    // point the directory slots with the high bit set to the new bucket
+    FOR_BUCKET_SLOTS(i, directory, old_bucket->local_depth, h) {
+        if (i & high_bit) {
+            directory->buckets[i] = new_page->pid;
+        }
+    }
+
+    size_t h0 = h & (high_bit - 1);
+    _set_bucket_filter(map, directory, bucket0->local_depth, h0, &filter0);
+    _set_bucket_filter(map, directory, bucket1->local_depth, h0 | high_bit,
+                       &filter1);
+
+    directory_page->dirty = true;
+    bucket_page->dirty = true;
+    new_page->dirty = true;
+    page_write_end(new_page);
+    page_write_end(directory_page);
+    cache_unpin(map->pc, new_page);
+
+    return true;
+}
+
 bool map_insert(Map *map, char *key, size_t klen, char *value, size_t vlen) {
+    const size_t entry_size = ENTRY_HEADER_SIZE + klen + vlen;
+    if (sizeof(Bucket) + entry_size > PAGE_SIZE) {
+        return false;
+    }
+
     Page *directory_page = NULL;
     if (!cache_fetch_or_set(map->pc, &map->directory_pid, &directory_page)) {
         return false;
     };
     Directory *directory = (Directory *)directory_page->data;
 
-    size_t i = hash(key) & ((1 << directory->global_depth) - 1);
-    Page *bucket_page = NULL;
-    if (!cache_fetch_or_set(map->pc, &directory->buckets[i], &bucket_page)) {
+    if (!_pin_filters(map, directory_page, 1 << directory->global_depth)) {
+        cache_unpin(map->pc, directory_page);
         return false;
     }
-    Bucket *bucket = (Bucket *)bucket_page->data;
 
-    const size_t entry_size = klen + vlen;
-    bool full = sizeof(Bucket) + bucket->size + entry_size >= PAGE_SIZE;
-    if (!full) {
-        bucket_put(bucket, key, klen, value, vlen);
+    size_t h = map_hash(key, klen);
+    for (;;) {
+        size_t i = h & ((1 << directory->global_depth) - 1);
+        bool fresh = directory->buckets[i] == 0;
+        Page *bucket_page = NULL;
+        if (fresh) {
+            page_write_begin(directory_page);
+        }
+        bool ok = cache_fetch_or_set(map->pc, &directory->buckets[i],
+                                     &bucket_page);
+        if (fresh) {
+            directory_page->dirty = true;
+            page_write_end(directory_page);
+        }
+        if (!ok) {
+            cache_unpin(map->pc, directory_page);
+            return false;
+        }
+        Bucket *bucket = (Bucket *)bucket_page->data;
 
-        cache_unpin(map->pc, directory_page);
+        // An existing entry for the key is replaced, so its space is reused
+        char *old_value = NULL;
+        size_t old_vlen = 0, old_size = 0;
+        if (bucket_get(bucket, key, klen, &old_value, &old_vlen)) {
+            old_size = ENTRY_HEADER_SIZE + klen + old_vlen;
+        }
+
+        bool full =
+            sizeof(Bucket) + bucket->size - old_size + entry_size > PAGE_SIZE;
+        page_write_begin(bucket_page);
+        if (!full) {
+            if (old_size > 0) {
+                bucket_remove(bucket, key, klen);
+            }
+            bucket_put(bucket, key, klen, value, vlen);
+            bucket_page->dirty = true;
+            page_write_end(bucket_page);
+            _add_bucket_filter(map, directory, bucket->local_depth, h);
+            if (map->hot != NULL) {
+                hot_update(map->hot, h, key, klen, value, vlen);
+            }
+
+            cache_unpin(map->pc, directory_page);
+            cache_unpin(map->pc, bucket_page);
+            return true;
+        }
+
+        bool split = _split_bucket(map, directory_page, bucket_page, h);
+        page_write_end(bucket_page);
         cache_unpin(map->pc, bucket_page);
-        return true;
+        if (!split) {
+            cache_unpin(map->pc, directory_page);
+            return false;
+        }
     }
+}
 
-    /* split the bucket */
+// Returns true if at the given depth no bucket holds more than a page, given
+// the size of the entries in each slot at the max depth
+static bool _load_fits(const size_t *sizes, size_t depth) {
+    size_t n = 1 << depth;
+    for (size_t b = 0; b < n; b++) {
+        size_t size = 0;
+        for (size_t i = b; i < (1 << DIRECTORY_MAX_DEPTH); i += n) {
+            size += sizes[i];
+        }
 
-    if (bucket->local_depth == directory->global_depth) {
-        directory->global_depth++;
+        if (size > BUCKET_CAPACITY) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Spooled entries are encoded hash|keylen|vallen|key|val
+static bool _spool_put(FILE *spool, size_t h, char *key, size_t klen,
+                       char *value, size_t vlen) {
+    return fwrite(&h, sizeof(size_t), 1, spool) == 1 &&
+           fwrite(&klen, sizeof(size_t), 1, spool) == 1 &&
+           fwrite(&vlen, sizeof(size_t), 1, spool) == 1 &&
+           fwrite(key, 1, klen, spool) == klen &&
+           fwrite(value, 1, vlen, spool) == vlen;
+}
+
+typedef enum { SPOOL_ENTRY, SPOOL_END, SPOOL_ERROR } SpoolRead;
+
+// The key and value are read into data, which must hold a page. A record cut
+// short, by a read error or a truncated spool, is an error rather than the end
+static SpoolRead _spool_next(FILE *spool, size_t *h, char *data, size_t *klen,
+                             size_t *vlen) {
+    if (fread(h, sizeof(size_t), 1, spool) != 1) {
+        return feof(spool) && !ferror(spool) ? SPOOL_END : SPOOL_ERROR;
+    }
+
+    if (fread(klen, sizeof(size_t), 1, spool) != 1 ||
+        fread(vlen, sizeof(size_t), 1, spool) != 1 ||
+        *klen + *vlen > BUCKET_CAPACITY) {
+        return SPOOL_ERROR;
+    }
+
+    size_t size = *klen + *vlen;
+    return fread(data, 1, size, spool) == size ? SPOOL_ENTRY : SPOOL_ERROR;
+}
+
+static void _close_runs(FILE **runs, size_t n) {
+    for (size_t g = 0; g < n; g++) {
+        if (runs[g] != NULL) {
+            fclose(runs[g]);
+        }
+    }
+    free(runs);
+}
+
+// Split the spool into one run per group of per_pass slots, reading it once
+static bool _spool_partition(FILE *spool, FILE **runs, size_t groups,
+                             size_t n, size_t per_pass) {
+    for (size_t g = 0; g < groups; g++) {
+        runs[g] = tmpfile();
+        if (runs[g] == NULL) {
+            return false;
+        }
     }
 
-    Page *page0, *page1 = NULL;
-    if (!cache_new_page(map->pc, &page0)) {
+    rewind(spool);
+    char data[PAGE_SIZE];
+    size_t h = 0, klen = 0, vlen = 0;
+    SpoolRead read = SPOOL_ENTRY;
+    while ((read = _spool_next(spool, &h, data, &klen, &vlen)) ==
+           SPOOL_ENTRY) {
+        if (!_spool_put(runs[(h & (n - 1)) / per_pass], h, data, klen,
+                        data + klen, vlen)) {
+            return false;
+        }
+    }
+
+    return read == SPOOL_END;
+}
+
+bool map_bulk_load(Map *map, MapLoadNext next, void *ctx, size_t memory) {
+    if (map->directory_pid != 0) {
         return false;
-    };
-    if (!cache_new_page(map->pc, &page1)) {
-        // TODO: free p0
+    }
+
+    FILE *spool = tmpfile();
+    if (spool == NULL) {
         return false;
-    };
+    }
 
-    Bucket *bucket0 = (Bucket *)page0->data;
-    Bucket *bucket1 = (Bucket *)page1->data;
-    bucket0->local_depth = bucket1->local_depth = bucket->local_depth + 1;
+    // Spool the input, recording the size of each slot at the max depth
+    size_t sizes[1 << DIRECTORY_MAX_DEPTH] = {0};
+    char *key = NULL, *value = NULL;
+    size_t klen = 0, vlen = 0;
+    while (next(ctx, &key, &klen, &value, &vlen)) {
+        const size_t entry_size = ENTRY_HEADER_SIZE + klen + vlen;
+        size_t h = map_hash(key, klen);
+        if (entry_size > BUCKET_CAPACITY ||
+            !_spool_put(spool, h, key, klen, value, vlen)) {
+            fclose(spool);
+            return false;
+        }
 
-    // split entries between the new buckets
-    int high_bit = 1 << bucket->local_depth;
-    BucketIter iter = {0};
-    bucket_iter_init(bucket, &iter);
-    char **ikey = NULL, **ivalue = NULL;
-    size_t iklen = 0, ivlen = 0;
-    while (bucket_iter_next(&iter, ikey, &iklen, ivalue, &ivlen)) {
-        if (hash(*ikey) & high_bit) {
-            bucket_put(bucket1, *ikey, iklen, *ivalue, ivlen);
-        } else {
-            bucket_put(bucket0, *ikey, iklen, *ivalue, ivlen);
+        sizes[h & ((1 << DIRECTORY_MAX_DEPTH) - 1)] += entry_size;
+    }
+
+    size_t depth = 0;
+    while (!_load_fits(sizes, depth)) {
+        if (depth == DIRECTORY_MAX_DEPTH) {
+            fclose(spool);
+            return false;
         }
+        depth++;
+    }
+
+    size_t n = 1 << depth;
+    size_t per_pass = memory / PAGE_SIZE;
+    if (per_pass == 0) {
+        per_pass = 1;
+    } else if (per_pass > n) {
+        per_pass = n;
     }
 
-    // insert requested entry
-    if (hash(key) & high_bit) {
-        bucket_put(bucket1, key, klen, value, vlen);
+    // Each group of buckets that fits in memory is filled from its own run. A
+    // single group is filled straight from the spool
+    size_t groups = (n + per_pass - 1) / per_pass;
+    FILE **runs = calloc(groups, sizeof(FILE *));
+    if (groups == 1) {
+        runs[0] = spool;
     } else {
-        bucket_put(bucket0, key, klen, value, vlen);
+        bool ok = _spool_partition(spool, runs, groups, n, per_pass);
+        fclose(spool);
+        if (!ok) {
+            _close_runs(runs, groups);
+            return false;
+        }
     }
 
-    // insert buckets into directory
-    for (size_t i = hash(key) & (high_bit - 1);
-         i < (1 < directory->global_depth); i += high_bit) {
-        if (i & high_bit) {
-            directory->buckets[i] = page1->pid;
-        } else {
-            directory->buckets[i] = page0->pid;
+    Page *directory_page = NULL;
+    if (!cache_fetch_or_set(map->pc, &map->directory_pid, &directory_page)) {
+        _close_runs(runs, groups);
+        return false;
+    }
+    Directory *directory = (Directory *)directory_page->data;
+    directory->global_depth = depth;
+    directory_page->dirty = true;
+
+    if (!_pin_filters(map, directory_page, n)) {
+        cache_unpin(map->pc, directory_page);
+        _close_runs(runs, groups);
+        return false;
+    }
+
+    // Every slot gets its own bucket, allocated as one run so the buckets can
+    // be written in pid order
+    pageid_t first = disk_alloc_run(&map->pc->dm, n);
+    for (size_t i = 0; i < n; i++) {
+        directory->buckets[i] = first + i;
+    }
+
+    char *pages = malloc(per_pass * PAGE_SIZE);
+    char data[PAGE_SIZE];
+    size_t h = 0;
+    SpoolRead read = SPOOL_END;
+    for (size_t g = 0; g < groups; g++) {
+        size_t lo = g * per_pass;
+        size_t hi = lo + per_pass < n ? lo + per_pass : n;
+
+        memset(pages, 0, (hi - lo) * PAGE_SIZE);
+        for (size_t i = lo; i < hi; i++) {
+            Bucket *bucket = (Bucket *)(pages + (i - lo) * PAGE_SIZE);
+            bucket->local_depth = depth;
+        }
+
+        rewind(runs[g]);
+        while ((read = _spool_next(runs[g], &h, data, &klen, &vlen)) ==
+               SPOOL_ENTRY) {
+            size_t i = h & (n - 1);
+            Bucket *bucket = (Bucket *)(pages + (i - lo) * PAGE_SIZE);
+            bucket_remove(bucket, data, klen);
+            bucket_put(bucket, data, klen, data + klen, vlen);
+            filter_add(_slot_filter(map, i), h);
+        }
+        if (read == SPOOL_ERROR) {
+            break;
+        }
+
+        cache_write_pages(map->pc, first + lo, hi - lo, pages);
+    }
+
+    for (size_t p = 0; p < DIRECTORY_FILTER_PAGES; p++) {
+        if (map->filter_pages[p] != NULL) {
+            map->filter_pages[p]->dirty = true;
         }
     }
 
-    // TODO: free bucket page for reuse
+    free(pages);
+    _close_runs(runs, groups);
     cache_unpin(map->pc, directory_page);
-    cache_unpin(map->pc, bucket_page);
-    cache_unpin(map->pc, page0);
-    cache_unpin(map->pc, page1);
 
-    return true;
+    return read != SPOOL_ERROR;
+}
+
+static int _cmp_pid(const void *a, const void *b) {
+    pageid_t x = *(const pageid_t *)a, y = *(const pageid_t *)b;
+    return (x > y) - (x < y);
+}
+
+bool map_scan_snapshot(Map *map, DiskSnapshot *snapshot, MapScanNext next,
+                       void *ctx) {
+    // The map was empty when the snapshot was taken
+    if (map->directory_pid == 0 || map->directory_pid > snapshot->next) {
+        return true;
+    }
+
+    char data[PAGE_SIZE];
+    disk_snapshot_read(snapshot, map->directory_pid, data);
+    Directory *directory = (Directory *)data;
+
+    // Slots that share a bucket hold the same pid
+    size_t n = 1 << directory->global_depth;
+    pageid_t *pids = malloc(n * sizeof(pageid_t));
+    memcpy(pids, directory->buckets, n * sizeof(pageid_t));
+    qsort(pids, n, sizeof(pageid_t), _cmp_pid);
+
+    bool ok = true;
+    char *key = NULL, *value = NULL;
+    size_t klen = 0, vlen = 0;
+    for (size_t i = 0; i < n && ok; i++) {
+        if (i > 0 && pids[i] == pids[i - 1]) {
+            continue;
+        }
+
+        disk_snapshot_read(snapshot, pids[i], data);
+        BucketIter iter = {0};
+        bucket_iter_init((Bucket *)data, &iter);
+        while (ok && bucket_iter_next(&iter, &key, &klen, &value, &vlen)) {
+            ok = next(ctx, key, klen, value, vlen);
+        }
+    }
+
+    free(pids);
+
+    return ok;
 }
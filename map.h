@@ -1,16 +1,71 @@
+#pragma once
+
 #include "cache.h"
 #include "disk.h"
+#include "filter.h"
+#include "hot.h"
+
+// Pointers to buckets. The directory lives in a single page, so the global
+// depth is bounded by the number of pids that fit in it
+#define DIRECTORY_MAX_DEPTH 9
+
+// Each directory slot has a filter of the keys in its bucket, so a lookup of a
+// missing key can usually be answered without reading the bucket. Like the
+// bucket pids, slots that share a bucket hold copies of the same filter
+#define FILTERS_PER_PAGE (PAGE_SIZE / sizeof(Filter))
+#define DIRECTORY_FILTER_PAGES ((1 << DIRECTORY_MAX_DEPTH) / FILTERS_PER_PAGE)
+
+typedef struct MapStats MapStats;
+struct MapStats {
+    size_t filter_negatives;       /* misses answered by the filter */
+    size_t filter_false_positives; /* misses the filter let through */
+    size_t filter_unpinned;        /* misses read with no filter pinned */
+};
 
+// map_read can be called from any number of threads alongside one thread that
+// calls map_insert. The other functions must not run concurrently with
+// anything else on the map
 typedef struct Map Map;
 struct Map {
     PageCache *pc;
     pageid_t directory_pid;
+    bool optimistic; /* map_read reads resident pages without pinning them */
+    bool readahead;  /* map_get_batch starts disk reads of missing buckets */
+    Page *filter_pages[DIRECTORY_FILTER_PAGES]; /* pinned until map_close */
+    Hot *hot; /* pairs read by map_get, NULL unless map_hot_init was called */
+    MapStats stats;
+};
+
+// A lookup run by map_get_batch. The caller fills in the key and the value
+// buffer, the rest is the state of the lookup between steps
+#define MAP_LOOKUP_GROUP 16 /* lookups in flight at once */
+
+typedef enum {
+    LOOKUP_START,  /* prefetch the directory slot and its filter */
+    LOOKUP_SLOT,   /* check the filter and prefetch the bucket page */
+    LOOKUP_BUCKET, /* search the bucket */
+    LOOKUP_DONE,
+} MapLookupState;
+
+typedef struct MapLookup MapLookup;
+struct MapLookup {
+    char *key;
+    size_t klen;
+    char *value; /* holds vlen bytes */
+    size_t vlen; /* capacity of value, then the length of the value found */
+    bool found;
+
+    MapLookupState state;
+    size_t hash;
+    size_t slot;
+    pageid_t bucket_pid;
+    bool filtered; /* the bucket is read because its filter held the hash */
 };
 
-// Pointers to buckets
 typedef struct Directory Directory;
 struct Directory {
     size_t global_depth; /* used to compute the index of a hash */
+    pageid_t filters[DIRECTORY_FILTER_PAGES];
     pageid_t buckets[];
 };
 
@@ -31,10 +86,73 @@ struct BucketIter {
 };
 
 bool bucket_put(Bucket *, char *, size_t, char *, size_t);
+bool bucket_get(Bucket *, char *, size_t, char **, size_t *);
+// Remove the entry for the key, shifting the following entries down. Returns
+// false if the key is not in the bucket
+bool bucket_remove(Bucket *, char *, size_t);
 
 void bucket_iter_init(Bucket *, BucketIter *);
 bool bucket_iter_next(BucketIter *, char **, size_t *, char **, size_t *);
 
+// The directory uses the low DIRECTORY_MAX_DEPTH bits and the filters use bits
+// 12 to 47. The bits from MAP_HASH_FREE_BIT up aren't used by a map, so they
+// can route keys between maps
+#define MAP_HASH_FREE_BIT 48
+size_t map_hash(char *, size_t);
+
 void map_init(Map *, PageCache *);
+// Open an existing map whose directory is at the given page
+void map_open(Map *, PageCache *, pageid_t);
+// Unpin the filter pages and free the hot cache
+void map_close(Map *);
+// Cache the pairs map_get reads within the given number of bytes. Writes
+// through the map keep the cache coherent. Only map_get reads it: map_read can
+// run alongside a writer, and map_get_batch copies values out while it steps
+// through buckets in groups, so both always go to the pages
+void map_hot_init(Map *, size_t);
+// Insert or replace the value for a key. Returns false if the entry can't be
+// placed, either because the cache has no free or evictable page or the
+// directory is full
 bool map_insert(Map *, char *, size_t, char *, size_t);
+// Remove the entry for the key. Returns false if the key isn't in the map
+bool map_delete(Map *, char *, size_t);
+// The value points into a cache page or the hot cache and is only valid until
+// the next call into the map or its page cache
 bool map_get(Map *, char *, size_t, char **, size_t *);
+
+// Run the lookups interleaved: each step of a lookup prefetches what its next
+// step reads and then yields to the other lookups in flight, so their cache
+// misses overlap. With readahead, buckets that aren't resident are also read
+// ahead from disk, which costs a syscall that only pays off if the read goes
+// to the device. Values are copied out as in map_read and
+// values that don't fit count as not found. Returns the number found
+size_t map_get_batch(Map *, MapLookup *, size_t);
+
+// Copy the value for the key into value, which holds *vlen bytes. Pages are
+// read without a pin or latch and the read is retried if a page was written in
+// the meantime. Pages that aren't resident are pinned. A value longer than *vlen
+// isn't copied: false is returned with *vlen set to the value's length
+bool map_read(Map *, char *, size_t, char *, size_t *);
+
+// Source of key/value pairs for map_bulk_load. Returns false at the end of the
+// input. The key and value only need to be valid until the next call
+typedef bool (*MapLoadNext)(void *, char **, size_t *, char **, size_t *);
+
+// Build an empty map from a stream of key/value pairs. The input is spooled to
+// a temporary file and the global depth is picked so every bucket fits. The
+// spool is then split once into a run per group of buckets that fits in the
+// given memory budget, and each group is filled from its run, each page
+// written once in pid order. Later duplicates of a key replace earlier ones.
+// Returns false if the map isn't empty, the input doesn't fit or the spool
+// can't be written or read back. A map that failed while its runs were read
+// back holds part of the input and should be discarded
+bool map_bulk_load(Map *, MapLoadNext, void *, size_t);
+
+// Called with each entry of a scan. Returns false to stop the scan
+typedef bool (*MapScanNext)(void *, char *, size_t, char *, size_t);
+
+// Call next with every entry of the map as it was when the snapshot was taken.
+// Pages are read from the snapshot rather than the cache, so the scan sees no
+// writes made since and can run alongside them. Buckets are read in pid order.
+// Returns false if the scan was stopped
+bool map_scan_snapshot(Map *, DiskSnapshot *, MapScanNext, void *);
@@ -5,28 +5,51 @@
 
 set -e
 
+CC=${CC:-clang}
+
 files=(
     disk.c
     cache.c
     map.c
+    filter.c
+    store.c
+    lz.c
+    clock.c
+    tier.c
+    hot.c
 )
 
 test_files=(
+    test_disk.c
     test_cache.c
     test_map.c
+    test_filter.c
+    test_store.c
+    test_tier.c
+    test_hot.c
 )
 
-if [ $1 = 'test' ]
+if [ "$1" = 'test' ]
 then
-    clang test.c ${files[@]} ${test_files[@]} -o test \
+    $CC test.c ${files[@]} ${test_files[@]} -o test \
         -pedantic -Wall -Wextra \
         -fsanitize=address,undefined \
-        -g3 -std=c2x
+        -g3 -std=c2x -pthread
     ./test
     exit 0
 fi
 
-clang main.c ${files[@]} -o main \
+if [ "$1" = 'bench' ]
+then
+    $CC bench.c ${files[@]} -o bench \
+        -pedantic -Wall -Wextra \
+        -O3 -march=native -DNDEBUG \
+        -std=c2x -pthread -lm
+    ./bench "${@:2}"
+    exit 0
+fi
+
+$CC main.c ${files[@]} -o main \
     -pedantic -Wall -Wextra \
     -fsanitize=address,undefined \
     -g3 -std=c2x
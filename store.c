@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "store.h"
+
+bool queue_push(StoreQueue *queue, StoreRequest *request) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == STORE_QUEUE_SIZE) {
+        return false;
+    }
+
+    queue->requests[tail & (STORE_QUEUE_SIZE - 1)] = request;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+bool queue_pop(StoreQueue *queue, StoreRequest **request) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+
+    *request = queue->requests[head & (STORE_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+static void _store_execute(StorePartition *part, StoreRequest *request) {
+    switch (request->op) {
+    case STORE_GET: {
+        char *value = NULL;
+        size_t vlen = 0;
+        bool found =
+            map_get(&part->map, request->key, request->klen, &value, &vlen);
+        request->ok = found && vlen <= STORE_MAX_VALUE;
+        request->vlen = found ? vlen : 0;
+        if (request->ok) {
+            memcpy(request->value, value, vlen);
+        }
+        break;
+    }
+    case STORE_INSERT:
+        request->ok = map_insert(&part->map, request->key, request->klen,
+                                 request->value, request->vlen);
+        break;
+    }
+
+    atomic_store_explicit(&request->done, true, memory_order_release);
+}
+
+// Drain the queues of every client. Returns the number of requests executed
+static size_t _store_poll(StorePartition *part) {
+    size_t n = 0;
+    StoreRequest *request = NULL;
+    for (size_t c = 0; c < part->store->clients; c++) {
+        while (queue_pop(&part->queues[c], &request)) {
+            _store_execute(part, request);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static void *_store_worker(void *arg) {
+    StorePartition *part = arg;
+
+#ifdef __linux__
+    // Keep each partition on its own core where there are enough of them
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0 && part->store->partitions <= (size_t)cores) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(part->id, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    while (!atomic_load_explicit(&part->store->stop, memory_order_acquire)) {
+        if (_store_poll(part) == 0) {
+            sched_yield();
+        }
+    }
+
+    // Requests submitted before the store was closed
+    _store_poll(part);
+
+    return NULL;
+}
+
+void store_open(char *path, size_t partitions, size_t clients, Store *store) {
+    store->partitions = partitions;
+    store->clients = clients;
+    store->parts = calloc(partitions, sizeof(StorePartition));
+    atomic_init(&store->stop, false);
+
+    char part_path[4096];
+    for (size_t i = 0; i < partitions; i++) {
+        StorePartition *part = &store->parts[i];
+        part->store = store;
+        part->id = i;
+
+        snprintf(part_path, sizeof(part_path), "%s.%zu", path, i);
+        cache_init(part_path, &part->pc);
+        map_init(&part->map, &part->pc);
+
+        part->queues = aligned_alloc(_Alignof(StoreQueue),
+                                     clients * sizeof(StoreQueue));
+        for (size_t c = 0; c < clients; c++) {
+            atomic_init(&part->queues[c].head, 0);
+            atomic_init(&part->queues[c].tail, 0);
+        }
+    }
+
+    for (size_t i = 0; i < partitions; i++) {
+        StorePartition *part = &store->parts[i];
+        int err = pthread_create(&part->thread, NULL, _store_worker, part);
+        if (err != 0) {
+            printf("could not start partition %zu: %s\n", i, strerror(err));
+            exit(1);
+        }
+    }
+
+    return;
+}
+
+void store_close(Store *store) {
+    atomic_store_explicit(&store->stop, true, memory_order_release);
+
+    for (size_t i = 0; i < store->partitions; i++) {
+        StorePartition *part = &store->parts[i];
+        pthread_join(part->thread, NULL);
+
+        map_close(&part->map);
+        cache_close(&part->pc);
+        free(part->queues);
+    }
+
+    free(store->parts);
+    *store = (Store){0};
+
+    return;
+}
+
+size_t store_partition(const Store *store, char *key, size_t klen) {
+    // Scale the free bits into [0, partitions)
+    size_t bits = map_hash(key, klen) >> MAP_HASH_FREE_BIT;
+    return (bits * store->partitions) >> (64 - MAP_HASH_FREE_BIT);
+}
+
+bool store_submit(Store *store, size_t client, StoreRequest *request) {
+    assert(client < store->clients);
+    assert(request->klen <= STORE_MAX_KEY && request->vlen <= STORE_MAX_VALUE);
+
+    StorePartition *part =
+        &store->parts[store_partition(store, request->key, request->klen)];
+    atomic_store_explicit(&request->done, false, memory_order_relaxed);
+
+    return queue_push(&part->queues[client], request);
+}
+
+bool store_done(StoreRequest *request) {
+    return atomic_load_explicit(&request->done, memory_order_acquire);
+}
+
+void store_wait(StoreRequest *request) {
+    while (!store_done(request)) {
+        sched_yield();
+    }
+
+    return;
+}
+
+static void _store_submit_wait(Store *store, size_t client,
+                               StoreRequest *request) {
+    while (!store_submit(store, client, request)) {
+        sched_yield();
+    }
+
+    store_wait(request);
+}
+
+bool store_get(Store *store, size_t client, char *key, size_t klen,
+               char *value, size_t *vlen) {
+    if (klen > STORE_MAX_KEY) {
+        *vlen = 0;
+        return false;
+    }
+
+    StoreRequest request = {.op = STORE_GET, .klen = klen};
+    memcpy(request.key, key, klen);
+    _store_submit_wait(store, client, &request);
+    *vlen = request.vlen;
+    if (!request.ok) {
+        return false;
+    }
+
+    memcpy(value, request.value, request.vlen);
+
+    return true;
+}
+
+bool store_insert(Store *store, size_t client, char *key, size_t klen,
+                  char *value, size_t vlen) {
+    if (klen > STORE_MAX_KEY || vlen > STORE_MAX_VALUE) {
+        return false;
+    }
+
+    StoreRequest request = {.op = STORE_INSERT, .klen = klen, .vlen = vlen};
+    memcpy(request.key, key, klen);
+    memcpy(request.value, value, vlen);
+    _store_submit_wait(store, client, &request);
+
+    return request.ok;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "map.h"
+
+// A store splits keys between partitions that share nothing. Each partition
+// has its own Map, PageCache and file, and is only touched by its own thread.
+// Clients hand requests to the owning partition through a single producer
+// single consumer queue per client and partition, so no locks are taken
+
+#define STORE_QUEUE_SIZE 256 /* must be a power of two */
+#define STORE_MAX_KEY 256
+#define STORE_MAX_VALUE 1024
+
+typedef enum { STORE_GET, STORE_INSERT } StoreOp;
+
+// A request belongs to the client until it is done. Keys and values are
+// copied in and out so nothing points into a partition's cache. A get of a
+// value longer than STORE_MAX_VALUE isn't ok but still sets vlen to the
+// value's length, while a get of a missing key sets it to 0
+typedef struct StoreRequest StoreRequest;
+struct StoreRequest {
+    StoreOp op;
+    size_t klen;
+    size_t vlen;
+    bool ok;
+    atomic_bool done;
+    char key[STORE_MAX_KEY];
+    char value[STORE_MAX_VALUE];
+};
+
+typedef struct StoreQueue StoreQueue;
+struct StoreQueue {
+    _Alignas(64) atomic_size_t head; /* next request to pop, set by consumer */
+    _Alignas(64) atomic_size_t tail; /* next slot to push, set by producer */
+    StoreRequest *requests[STORE_QUEUE_SIZE];
+};
+
+typedef struct Store Store;
+
+typedef struct StorePartition StorePartition;
+struct StorePartition {
+    Store *store;
+    size_t id;
+    PageCache pc;
+    Map map;
+    StoreQueue *queues; /* one per client */
+    pthread_t thread;
+};
+
+struct Store {
+    size_t partitions;
+    size_t clients;
+    StorePartition *parts;
+    atomic_bool stop;
+};
+
+// Open a store with the given number of partitions, each in the file
+// <path>.<partition>, and clients. A client id must only be used by one
+// thread at a time
+void store_open(char *, size_t, size_t, Store *);
+// Stop the partitions once their queues are drained and close them
+void store_close(Store *);
+// The partition that owns the key
+size_t store_partition(const Store *, char *, size_t);
+// Queue the request on the owning partition. Returns false if the queue is
+// full
+bool store_submit(Store *, size_t, StoreRequest *);
+bool store_done(StoreRequest *);
+void store_wait(StoreRequest *);
+// Synchronous helpers. The value of store_get must hold STORE_MAX_VALUE bytes.
+// When store_get returns false, *vlen is 0 if the key is missing or the length
+// of a value too long to copy out
+bool store_get(Store *, size_t, char *, size_t, char *, size_t *);
+bool store_insert(Store *, size_t, char *, size_t, char *, size_t);
+
+bool queue_push(StoreQueue *, StoreRequest *);
+bool queue_pop(StoreQueue *, StoreRequest **);
@@ -2,8 +2,29 @@
 
 #include "test.h"
 
+void test_remove(char *path) {
+    if (path[0] == 0) {
+        return;
+    }
+
+    remove(path);
+
+    char part_path[4096];
+    for (size_t i = 0;; i++) {
+        snprintf(part_path, sizeof(part_path), "%s.%zu", path, i);
+        if (remove(part_path) != 0) {
+            break;
+        }
+    }
+}
+
 int main(void) {
     printf("Running tests...\n");
+    test_disk();
     test_cache();
     test_map();
+    test_filter();
+    test_store();
+    test_tier();
+    test_hot();
 }
@@ -1,13 +1,26 @@
 #include <assert.h>
 #include <stdio.h>
 
+#ifndef __ASSERT_FILE_NAME
+#define __ASSERT_FILE_NAME __FILE__
+#endif
+
 #define TEST(e)                                                                \
     if (!(e)) {                                                                \
         printf("FAIL: %s:%d %s %s\n", __ASSERT_FILE_NAME, __LINE__, __func__,  \
                #e);                                                            \
-        remove(test_store_file);                                               \
+        test_remove(test_store_file);                                          \
         return false;                                                          \
     }
 
+// Remove a test's store file and the per-partition files of a store opened at
+// the same path
+void test_remove(char *);
+
+void test_disk();
 void test_cache();
 void test_map();
+void test_filter();
+void test_store();
+void test_tier();
+void test_hot();
@@ -1,9 +1,18 @@
+#include <sched.h>
+#include <string.h>
+
 #include "cache.h"
 #include "test.h"
 
 static bool test_cache_single_page();
+static bool test_cache_mmap();
+static bool test_cache_warm();
 
-void test_cache() { test_cache_single_page(); }
+void test_cache() {
+    test_cache_single_page();
+    test_cache_mmap();
+    test_cache_warm();
+}
 
 static bool test_cache_single_page() {
     char *test_store_file = "test_cache_single_page.store";
@@ -84,6 +93,186 @@ static bool test_cache_single_page() {
     TEST(cache_new_page(&pc, &page));
     TEST(page->pid == FREE_LIST_PAGE_ID + 2);
 
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+static bool test_cache_mmap() {
+    char *test_store_file = "test_cache_mmap.store";
+
+    PageCache pc = {0};
+    cache_init_mmap(test_store_file, 4, &pc);
+
+    // Ensure pages point into the mapping
+    Page *page = NULL;
+    TEST(cache_new_page(&pc, &page));
+    TEST(page->pid == FREE_LIST_PAGE_ID + 1);
+    TEST(page->data == pc.dm.map + page->pid * PAGE_SIZE);
+    memset(page->data, 'a', PAGE_SIZE);
+    page->dirty = true;
+    cache_unpin(&pc, page);
+
+    // Ensure the mapping grows past its initial size and evicted pages keep
+    // what was written to them
+    size_t n = 2 * DISK_MMAP_GROW / PAGE_SIZE;
+    for (size_t i = 0; i < n; i++) {
+        TEST(cache_new_page(&pc, &page));
+        memcpy(page->data, &i, sizeof(i));
+        page->dirty = true;
+        cache_unpin(&pc, page);
+    }
+    TEST(pc.dm.map_len >= (n + FREE_LIST_PAGE_ID + 2) * PAGE_SIZE);
+
+    TEST(cache_fetch_page(&pc, FREE_LIST_PAGE_ID + 1, &page));
+    TEST(page->data[0] == 'a' && page->data[PAGE_SIZE - 1] == 'a');
+    cache_unpin(&pc, page);
+
+    // Ensure pages written through the mapping are read back by the frame pool
+    cache_close(&pc);
+    cache_init_slots(test_store_file, 4, &pc);
+
+    TEST(cache_fetch_page(&pc, FREE_LIST_PAGE_ID + 1, &page));
+    TEST(page->data[0] == 'a' && page->data[PAGE_SIZE - 1] == 'a');
+    cache_unpin(&pc, page);
+
+    size_t i = 0;
+    TEST(cache_fetch_page(&pc, FREE_LIST_PAGE_ID + 2 + n - 1, &page));
+    memcpy(&i, page->data, sizeof(i));
+    TEST(i == n - 1);
+    cache_unpin(&pc, page);
+
+    TEST(cache_new_page(&pc, &page));
+    TEST(page->pid == FREE_LIST_PAGE_ID + 2 + n);
+    cache_unpin(&pc, page);
+
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+static bool test_cache_warm() {
+    char *test_store_file = "test_cache_warm.store";
+    char *test_warm_file = "test_cache_warm.store.warm";
+    remove(test_warm_file);
+
+    // Write 16 pages through a pool of 8, then touch 2 of the resident ones
+    // again so they have a full history
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 8, &pc);
+    TEST(cache_warm(&pc, test_warm_file, 0) == 0);
+
+    Page *page = NULL;
+    for (size_t i = 0; i < 16; i++) {
+        TEST(cache_new_page(&pc, &page));
+        memcpy(page->data, &i, sizeof(i));
+        page->dirty = true;
+        cache_unpin(&pc, page);
+    }
+
+    pageid_t hot[2] = {FREE_LIST_PAGE_ID + 11, FREE_LIST_PAGE_ID + 16};
+    for (size_t i = 0; i < 2 * LRUK; i++) {
+        TEST(cache_fetch_page(&pc, hot[i % 2], &page));
+        cache_unpin(&pc, page);
+    }
+
+    pageid_t resident[8];
+    LRUKHistory histories[8];
+    for (size_t i = 0; i < 8; i++) {
+        resident[i] = pc.pages[i].pid;
+        histories[i] = lru_find_entry(&pc.lru, i)->history;
+    }
+    cache_close(&pc);
+
+    // Ensure the same pages are resident after a restart, with their data and
+    // replacement state
+    cache_init_slots(test_store_file, 8, &pc);
+    TEST(cache_warm(&pc, test_warm_file, 0) == 8);
+    TEST(pc.free.len == 0);
+
+    for (size_t i = 0; i < 8; i++) {
+        TEST(cache_peek_page(&pc, resident[i], &page));
+        size_t value = 0;
+        memcpy(&value, page->data, sizeof(value));
+        TEST(value == resident[i] - FREE_LIST_PAGE_ID - 1);
+
+        LRUEntry *entry = lru_find_entry(&pc.lru, page - pc.pages);
+        TEST(entry->evictable);
+        TEST(entry->history.len == histories[i].len);
+        TEST(memcmp(entry->history.timestamps, histories[i].timestamps,
+                    histories[i].len * sizeof(unsigned int)) == 0);
+        TEST(pc.lru.timestamp > entry->history.timestamps[entry->history.len -
+                                                          1]);
+
+        // Peeking counts as a use, which would give every page another chance
+        atomic_store(&page->referenced, false);
+    }
+
+    // Ensure the hot pages outlast the rest
+    for (size_t i = 0; i < 6; i++) {
+        TEST(cache_new_page(&pc, &page));
+        cache_unpin(&pc, page);
+    }
+    for (size_t i = 0; i < 2; i++) {
+        TEST(cache_peek_page(&pc, hot[i], &page));
+    }
+    cache_close(&pc);
+
+    // Ensure only the pages the policy would keep are reloaded into a smaller
+    // pool
+    cache_init_slots(test_store_file, 2, &pc);
+    TEST(cache_warm(&pc, test_warm_file, 0) == 2);
+    for (size_t i = 0; i < 2; i++) {
+        TEST(cache_peek_page(&pc, hot[i], &page));
+    }
+    cache_close(&pc);
+
+    // Ensure a sidecar with a length past its end and the entries repeated
+    // loads each page once
+    char sidecar[4096];
+    FILE *f = fopen(test_warm_file, "rb");
+    TEST(f != NULL);
+    size_t size = fread(sidecar, 1, sizeof(sidecar) / 2, f);
+    fclose(f);
+    size_t header_size = 3 * sizeof(uint32_t);
+    memcpy(sidecar + size, sidecar + header_size, size - header_size);
+    size += size - header_size;
+    uint32_t len = UINT32_MAX;
+    memcpy(sidecar + sizeof(uint32_t), &len, sizeof(len));
+    f = fopen(test_warm_file, "wb");
+    TEST(f != NULL);
+    TEST(fwrite(sidecar, 1, size, f) == size);
+    fclose(f);
+
+    cache_init_slots(test_store_file, 8, &pc);
+    TEST(cache_warm(&pc, test_warm_file, 0) == 2);
+    TEST(pc.free.len == 6);
+    for (size_t i = 0; i < 2; i++) {
+        TEST(cache_peek_page(&pc, hot[i], &page));
+    }
+    cache_close(&pc);
+
+    // Ensure the dumper thread writes the sidecar without waiting for a close
+    remove(test_warm_file);
+    cache_init_slots(test_store_file, 8, &pc);
+    TEST(cache_warm(&pc, test_warm_file, 1) == 0);
+    TEST(cache_fetch_page(&pc, hot[0], &page));
+    cache_unpin(&pc, page);
+
+    f = NULL;
+    for (int i = 0; i < 1000 && f == NULL; i++) {
+        f = fopen(test_warm_file, "rb");
+        if (f == NULL) {
+            sched_yield();
+        }
+    }
+    TEST(f != NULL);
+    fclose(f);
+    cache_close(&pc);
+
+    remove(test_warm_file);
     remove(test_store_file);
     return true;
 }
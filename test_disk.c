@@ -0,0 +1,259 @@
+#include <string.h>
+#include <sys/stat.h>
+
+#include "disk.h"
+#include "test.h"
+
+static bool test_disk_extents();
+static bool test_disk_truncate_mmap();
+static bool test_disk_snapshot();
+
+void test_disk() {
+    test_disk_extents();
+    test_disk_truncate_mmap();
+    test_disk_snapshot();
+}
+
+static size_t _file_size(char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return 0;
+    }
+
+    return st.st_size;
+}
+
+static size_t _file_blocks(char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return 0;
+    }
+
+    return st.st_blocks;
+}
+
+static bool test_disk_extents() {
+    char *test_store_file = "test_disk_extents.store";
+
+    DiskManager dm = {0};
+    disk_open(test_store_file, &dm);
+
+    // Ensure an extent is reserved ahead of the first page, and the reserved
+    // mark survives a reopen
+    pageid_t pid = disk_alloc(&dm);
+    TEST(pid == FREE_LIST_PAGE_ID + 1);
+    TEST(dm.meta->reserved >= pid + DISK_EXTENT_MIN_PAGES);
+    pageid_t reserved = dm.meta->reserved;
+    disk_close(&dm);
+
+    disk_open(test_store_file, &dm);
+    TEST(dm.meta->reserved == reserved);
+    TEST(_file_size(test_store_file) >= ((size_t)reserved + 1) * PAGE_SIZE);
+
+    // Ensure a run past the reserved space reserves more
+    pageid_t run = disk_alloc_run(&dm, reserved);
+    TEST(run == pid + 1);
+    TEST(dm.meta->reserved >= run + reserved - 1);
+
+    char data[PAGE_SIZE];
+    memset(data, 'a', PAGE_SIZE);
+    for (size_t i = 0; i < DISK_PUNCH_PAGES; i++) {
+        disk_write(&dm, run + i, data);
+    }
+
+    // Ensure a run freed in the middle goes on the free list and a run at the
+    // end goes back to the allocator
+    disk_free_run(&dm, run, DISK_PUNCH_PAGES);
+    TEST(dm.free->len == DISK_PUNCH_PAGES);
+    TEST(disk_is_free(&dm, run + 1));
+
+    // Ensure a long run at the end keeps its space, since it is allocated
+    // again in order
+    pageid_t tail = disk_alloc_run(&dm, DISK_PUNCH_PAGES);
+    for (size_t i = 0; i < DISK_PUNCH_PAGES; i++) {
+        disk_write(&dm, tail + i, data);
+    }
+    size_t blocks = _file_blocks(test_store_file);
+    disk_free_run(&dm, tail, DISK_PUNCH_PAGES);
+    TEST(dm.meta->next == tail - 1);
+    TEST(_file_blocks(test_store_file) == blocks);
+
+    pageid_t next = dm.meta->next;
+    disk_free_run(&dm, next - 9, 10);
+    TEST(dm.meta->next == next - 10);
+    TEST(disk_alloc_run(&dm, 1) == next - 9);
+
+    // Ensure a reused page that had its space released reads back as zeros
+    pageid_t reused = disk_alloc(&dm);
+    TEST(reused >= run && reused < run + DISK_PUNCH_PAGES);
+    disk_read(&dm, reused, data);
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        TEST(data[i] == 0);
+    }
+
+    // Ensure truncating drops the free pages at the end and the reserved space
+    disk_free_run(&dm, run + DISK_PUNCH_PAGES, next - 9 - run - DISK_PUNCH_PAGES);
+    disk_free(&dm, next - 9);
+    disk_truncate(&dm);
+    TEST(dm.meta->next == run + DISK_PUNCH_PAGES - 1);
+    TEST(dm.meta->reserved == dm.meta->next);
+    TEST(dm.free->len == DISK_PUNCH_PAGES - 1);
+    TEST(_file_size(test_store_file) ==
+         ((size_t)dm.meta->next + 1) * PAGE_SIZE);
+
+    // Ensure a run the free list can't hold is refused before any of it is
+    // freed or released
+    size_t free_len = dm.free->len;
+    pageid_t large = disk_alloc_run(&dm, FREE_LIST_CAPACITY + 1);
+    disk_alloc_run(&dm, 1);
+    memset(data, 'a', PAGE_SIZE);
+    disk_write(&dm, large, data);
+    TEST(!disk_free_run(&dm, large, FREE_LIST_CAPACITY + 1));
+    TEST(dm.free->len == free_len);
+    TEST(!disk_is_free(&dm, large));
+    disk_read(&dm, large, data);
+    TEST(data[0] == 'a' && data[PAGE_SIZE - 1] == 'a');
+
+    disk_close(&dm);
+
+    remove(test_store_file);
+    return true;
+}
+
+static bool test_disk_truncate_mmap() {
+    char *test_store_file = "test_disk_truncate_mmap.store";
+
+    DiskManager dm = {0};
+    disk_open_mmap(test_store_file, &dm);
+
+    // Map a few growth chunks, then free all but the first chunk
+    const size_t chunk = DISK_MMAP_GROW / PAGE_SIZE;
+    pageid_t run = disk_alloc_run(&dm, 3 * chunk);
+    char *page = disk_page(&dm, run + 3 * chunk - 1);
+    memset(page, 'a', PAGE_SIZE);
+    TEST(dm.map_len >= 3 * DISK_MMAP_GROW);
+
+    disk_free_run(&dm, run + chunk, 2 * chunk);
+    disk_truncate(&dm);
+    TEST(dm.map_len == 2 * DISK_MMAP_GROW);
+    TEST(_file_size(test_store_file) == dm.map_len);
+
+    // Ensure the pages past the new end are mapped again from the file, which
+    // reads them back as zeros
+    pageid_t again = disk_alloc_run(&dm, 2 * chunk);
+    TEST(again == run + chunk);
+    page = disk_page(&dm, run + 3 * chunk - 1);
+    TEST(page[0] == 0 && page[PAGE_SIZE - 1] == 0);
+    memset(page, 'b', PAGE_SIZE);
+
+    char data[PAGE_SIZE];
+    disk_close(&dm);
+    disk_open(test_store_file, &dm);
+    disk_read(&dm, run + 3 * chunk - 1, data);
+    TEST(data[0] == 'b' && data[PAGE_SIZE - 1] == 'b');
+    disk_close(&dm);
+
+    remove(test_store_file);
+    return true;
+}
+
+static bool test_disk_snapshot() {
+    char *test_store_file = "test_disk_snapshot.store";
+    char *test_backup_file = "test_disk_snapshot.backup";
+
+    DiskManager dm = {0};
+    disk_open(test_store_file, &dm);
+
+    char data[PAGE_SIZE];
+    pageid_t pids[4];
+    for (int i = 0; i < 4; i++) {
+        pids[i] = disk_alloc(&dm);
+        memset(data, 'a' + i, PAGE_SIZE);
+        disk_write(&dm, pids[i], data);
+    }
+    disk_free(&dm, pids[3]);
+
+    DiskSnapshot snapshot = {0};
+    TEST(disk_snapshot(&dm, &snapshot));
+    TEST(!disk_snapshot(&dm, &(DiskSnapshot){0}));
+    pageid_t next = dm.meta->next;
+
+    // Ensure an overwritten page reads as it was in the snapshot, and only its
+    // first write copies it
+    memset(data, 'x', PAGE_SIZE);
+    disk_write(&dm, pids[0], data);
+    TEST(dm.meta->next == next + 1);
+    disk_write(&dm, pids[0], data);
+    TEST(dm.meta->next == next + 1);
+
+    disk_snapshot_read(&snapshot, pids[0], data);
+    TEST(data[0] == 'a' && data[PAGE_SIZE - 1] == 'a');
+    disk_read(&dm, pids[0], data);
+    TEST(data[0] == 'x');
+
+    // Ensure a page freed before the snapshot reads as zeros even once it is
+    // reused, and a page freed after it keeps its contents
+    TEST(disk_alloc(&dm) == pids[3]);
+    disk_write(&dm, pids[3], data);
+    disk_snapshot_read(&snapshot, pids[3], data);
+    TEST(data[0] == 0 && data[PAGE_SIZE - 1] == 0);
+
+    disk_free(&dm, pids[1]);
+    TEST(disk_alloc(&dm) == pids[1]);
+    memset(data, 'y', PAGE_SIZE);
+    disk_write(&dm, pids[1], data);
+    disk_snapshot_read(&snapshot, pids[1], data);
+    TEST(data[0] == 'b');
+
+    // Ensure the backup is a store file holding the snapshot
+    disk_snapshot_backup(&snapshot, test_backup_file);
+    DiskManager backup = {0};
+    disk_open(test_backup_file, &backup);
+    TEST(backup.meta->next == next);
+    TEST(disk_is_free(&backup, pids[3]));
+    for (int i = 0; i < 3; i++) {
+        disk_read(&backup, pids[i], data);
+        TEST(data[0] == 'a' + i && data[PAGE_SIZE - 1] == 'a' + i);
+    }
+    disk_close(&backup);
+
+    // Ensure releasing the snapshot gives the shadows back
+    disk_snapshot_release(&snapshot);
+    TEST(dm.meta->next == next);
+    TEST(dm.snapshot == NULL);
+    disk_read(&dm, pids[2], data);
+    TEST(data[0] == 'c');
+
+    // Ensure freeing the last page and truncating while a snapshot is held
+    // doesn't let a shadow overwrite a page in the snapshot
+    memset(data, 'd', PAGE_SIZE);
+    disk_write(&dm, pids[3], data);
+    TEST(disk_snapshot(&dm, &snapshot));
+    disk_free(&dm, pids[3]);
+    disk_truncate(&dm);
+    TEST(dm.meta->next == next);
+    memset(data, 'z', PAGE_SIZE);
+    disk_write(&dm, pids[0], data);
+    disk_snapshot_read(&snapshot, pids[3], data);
+    TEST(data[0] == 'd' && data[PAGE_SIZE - 1] == 'd');
+    disk_snapshot_release(&snapshot);
+
+    // Likewise when the last page is freed as a run
+    TEST(disk_alloc(&dm) == pids[3]);
+    memset(data, 'd', PAGE_SIZE);
+    disk_write(&dm, pids[3], data);
+    TEST(disk_snapshot(&dm, &snapshot));
+    TEST(disk_free_run(&dm, pids[3], 1));
+    TEST(dm.meta->next == next && disk_is_free(&dm, pids[3]));
+    memset(data, 'z', PAGE_SIZE);
+    disk_write(&dm, pids[1], data);
+    disk_snapshot_read(&snapshot, pids[3], data);
+    TEST(data[0] == 'd' && data[PAGE_SIZE - 1] == 'd');
+    disk_snapshot_release(&snapshot);
+
+    disk_close(&dm);
+
+    remove(test_store_file);
+    remove(test_backup_file);
+    return true;
+}
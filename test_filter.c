@@ -0,0 +1,45 @@
+#include "filter.h"
+#include "test.h"
+
+static bool test_filter_contains();
+
+void test_filter() { test_filter_contains(); }
+
+static uint64_t _mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccd;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53;
+    x ^= x >> 33;
+    return x;
+}
+
+static bool test_filter_contains() {
+    char *test_store_file = "";
+
+    Filter filter = {0};
+    filter_clear(&filter);
+
+    // Roughly the number of small entries in a bucket
+    const uint64_t n = 48;
+    for (uint64_t i = 0; i < n; i++) {
+        filter_add(&filter, _mix(i));
+    }
+
+    // Ensure there are no false negatives
+    for (uint64_t i = 0; i < n; i++) {
+        TEST(filter_contains(&filter, _mix(i)));
+    }
+
+    // Ensure most hashes that weren't added are ruled out
+    int false_positives = 0;
+    for (uint64_t i = n; i < n + 10000; i++) {
+        false_positives += filter_contains(&filter, _mix(i));
+    }
+    TEST(false_positives < 500);
+
+    filter_clear(&filter);
+    TEST(!filter_contains(&filter, _mix(0)));
+
+    return true;
+}
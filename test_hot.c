@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include "cache.h"
+#include "hot.h"
+#include "map.h"
+#include "test.h"
+
+static bool test_hot_budget();
+static bool test_hot_map();
+
+void test_hot() {
+    test_hot_budget();
+    test_hot_map();
+}
+
+static void _put(Hot *hot, int i, char *value) {
+    char key[32];
+    int klen = snprintf(key, sizeof(key), "key%d", i);
+    hot_put(hot, map_hash(key, klen), key, klen, value, strlen(value));
+}
+
+static bool _get(Hot *hot, int i, char *value) {
+    char key[32];
+    int klen = snprintf(key, sizeof(key), "key%d", i);
+    char *ivalue = NULL;
+    size_t ivlen = 0;
+    return hot_get(hot, map_hash(key, klen), key, klen, &ivalue, &ivlen) &&
+           ivlen == strlen(value) && memcmp(ivalue, value, ivlen) == 0;
+}
+
+static bool test_hot_budget() {
+    char *test_store_file = "";
+
+    // Room for four entries of 4 byte keys and 6 byte values
+    Hot hot = {0};
+    hot_init(&hot, 4 * HOT_ENTRY_BUDGET);
+    hot.budget = 40;
+
+    for (int i = 0; i < 4; i++) {
+        _put(&hot, i, "value0");
+    }
+    TEST(hot.stats.puts == 4 && hot.stats.evictions == 0);
+    TEST(hot.used == 40);
+
+    // Ensure a referenced entry survives the next eviction
+    TEST(_get(&hot, 0, "value0"));
+    _put(&hot, 4, "value0");
+    TEST(hot.stats.evictions == 1);
+    TEST(_get(&hot, 0, "value0"));
+    TEST(!_get(&hot, 1, "value0"));
+    TEST(_get(&hot, 4, "value0"));
+
+    // Ensure an update replaces a held value and leaves other keys out
+    char key[32];
+    int klen = snprintf(key, sizeof(key), "key%d", 0);
+    hot_update(&hot, map_hash(key, klen), key, klen, "value1", 6);
+    TEST(_get(&hot, 0, "value1"));
+    klen = snprintf(key, sizeof(key), "key%d", 1);
+    hot_update(&hot, map_hash(key, klen), key, klen, "value1", 6);
+    TEST(!_get(&hot, 1, "value1"));
+    TEST(hot.stats.updates == 1);
+
+    // Ensure a removed entry is gone and one over the limit isn't cached
+    klen = snprintf(key, sizeof(key), "key%d", 4);
+    hot_remove(&hot, map_hash(key, klen), key, klen);
+    TEST(!_get(&hot, 4, "value0"));
+    TEST(hot.used == 30);
+
+    char large[HOT_MAX_ENTRY + 1];
+    memset(large, 'a', HOT_MAX_ENTRY);
+    large[HOT_MAX_ENTRY] = 0;
+    hot.budget = 2 * HOT_MAX_ENTRY;
+    _put(&hot, 5, large);
+    TEST(!_get(&hot, 5, large));
+
+    hot_close(&hot);
+
+    return true;
+}
+
+static bool test_hot_map() {
+    char *test_store_file = "test_hot_map.store";
+
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 8, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+    map_hot_init(&map, 64 * HOT_ENTRY_BUDGET);
+
+    char key[32], value[64];
+    char *ivalue = NULL;
+    size_t ivlen = 0;
+    const int n = 500;
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+
+    // Ensure a read key is answered by the cache the next time
+    TEST(map_get(&map, "key7", 4, &ivalue, &ivlen));
+    TEST(map.hot->stats.misses == 1 && map.hot->stats.puts == 1);
+    TEST(map_get(&map, "key7", 4, &ivalue, &ivlen));
+    TEST(map.hot->stats.hits == 1);
+    TEST(ivlen == 6 && memcmp(ivalue, "value7", 6) == 0);
+
+    // Ensure writes through the map are seen by cached keys
+    TEST(map_insert(&map, "key7", 4, "new7", 4));
+    TEST(map_get(&map, "key7", 4, &ivalue, &ivlen));
+    TEST(ivlen == 4 && memcmp(ivalue, "new7", 4) == 0);
+
+    TEST(map_delete(&map, "key7", 4));
+    TEST(!map_get(&map, "key7", 4, &ivalue, &ivlen));
+    TEST(!map_delete(&map, "key7", 4));
+
+    // Ensure every key reads back through a cache smaller than the keys, with
+    // values replaced while they are cached
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n; i++) {
+            int klen = snprintf(key, sizeof(key), "key%d", i);
+            int vlen = snprintf(value, sizeof(value), "value%d.%d", i, round);
+            if (round == 1 && i != 7) {
+                TEST(map_insert(&map, key, klen, value, vlen));
+            } else if (round == 0) {
+                vlen = snprintf(value, sizeof(value), "value%d", i);
+            }
+
+            bool found = map_get(&map, key, klen, &ivalue, &ivlen);
+            TEST(found == (i != 7));
+            if (found) {
+                TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+            }
+        }
+    }
+    TEST(map.hot->used <= map.hot->budget);
+    TEST(map.hot->stats.evictions > 0);
+
+    map_close(&map);
+    TEST(map.hot == NULL);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
@@ -1,13 +1,27 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "cache.h"
 #include "map.h"
 #include "test.h"
 
 static bool test_map_insert_and_get();
 static bool test_map_split();
+static bool test_map_bulk_load();
+static bool test_map_read();
+static bool test_map_read_concurrent();
+static bool test_map_get_batch();
+static bool test_map_snapshot();
 
 void test_map() {
     test_map_insert_and_get();
     test_map_split();
+    test_map_bulk_load();
+    test_map_read();
+    test_map_read_concurrent();
+    test_map_get_batch();
+    test_map_snapshot();
 }
 
 static bool test_map_insert_and_get() {
@@ -26,13 +40,437 @@ static bool test_map_insert_and_get() {
     char *value = NULL;
     size_t vlen = 0;
     TEST(map_get(&map, "k3", 2, &value, &vlen));
+    TEST(vlen == 2 && memcmp(value, "v3", 2) == 0);
+    TEST(map_get(&map, "k22", 3, &value, &vlen));
+    TEST(vlen == 3 && memcmp(value, "v22", 3) == 0);
+    TEST(!map_get(&map, "k4", 2, &value, &vlen));
+
+    // Ensure an insert of an existing key replaces the value
+    TEST(map_insert(&map, "k1", 2, "v11", 3));
+    TEST(map_get(&map, "k1", 2, &value, &vlen));
+    TEST(vlen == 3 && memcmp(value, "v11", 3) == 0);
 
+    map_close(&map);
     cache_close(&pc);
 
+    remove(test_store_file);
     return true;
 }
 
 static bool test_map_split() {
-    //
+    char *test_store_file = "test_map_split.store";
+
+    // Use fewer slots than the map needs so buckets are evicted and read back
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 8, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    char key[32], value[64];
+    const int n = 2000;
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+
+    Page *directory_page = NULL;
+    TEST(cache_fetch_page(&pc, map.directory_pid, &directory_page));
+    TEST(((Directory *)directory_page->data)->global_depth > 0);
+    cache_unpin(&pc, directory_page);
+
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+
+        char *ivalue = NULL;
+        size_t ivlen = 0;
+        TEST(map_get(&map, key, klen, &ivalue, &ivlen));
+        TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+    }
+
+    // Ensure most missing keys are answered by the filters
+    for (int i = n; i < 2 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+
+        char *ivalue = NULL;
+        size_t ivlen = 0;
+        TEST(!map_get(&map, key, klen, &ivalue, &ivlen));
+    }
+    TEST(map.stats.filter_negatives + map.stats.filter_false_positives +
+             map.stats.filter_unpinned ==
+         (size_t)n);
+    TEST(map.stats.filter_negatives > map.stats.filter_false_positives);
+
+    map_close(&map);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+typedef struct TestLoad TestLoad;
+struct TestLoad {
+    int i;
+    int n;
+    char key[32];
+    char value[64];
+};
+
+// Yields key0..keyn-1 and then key0 again with a different value
+static bool _test_load_next(void *ctx, char **key, size_t *klen, char **value,
+                            size_t *vlen) {
+    TestLoad *load = ctx;
+    if (load->i > load->n) {
+        return false;
+    }
+
+    if (load->i == load->n) {
+        *klen = snprintf(load->key, sizeof(load->key), "key%d", 0);
+        *vlen = snprintf(load->value, sizeof(load->value), "replaced");
+    } else {
+        *klen = snprintf(load->key, sizeof(load->key), "key%d", load->i);
+        *vlen = snprintf(load->value, sizeof(load->value), "value%d", load->i);
+    }
+
+    *key = load->key;
+    *value = load->value;
+    load->i++;
+
+    return true;
+}
+
+static bool test_map_bulk_load() {
+    char *test_store_file = "test_map_bulk_load.store";
+
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 8, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    // Ensure the buckets are filled over several passes
+    const int n = 2000;
+    TestLoad load = {.i = 0, .n = n};
+    TEST(map_bulk_load(&map, _test_load_next, &load, 4 * PAGE_SIZE));
+
+    // Ensure a map can only be bulk loaded when empty
+    load = (TestLoad){.i = 0, .n = n};
+    TEST(!map_bulk_load(&map, _test_load_next, &load, 4 * PAGE_SIZE));
+
+    char key[32], value[64];
+    char *ivalue = NULL;
+    size_t ivlen = 0;
+    TEST(map_get(&map, "key0", 4, &ivalue, &ivlen));
+    TEST(ivlen == 8 && memcmp(ivalue, "replaced", 8) == 0);
+    for (int i = 1; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_get(&map, key, klen, &ivalue, &ivlen));
+        TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+    }
+    TEST(!map_get(&map, "key2000", 7, &ivalue, &ivlen));
+
+    // Ensure inserts after the load split the loaded buckets
+    for (int i = n; i < 2 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+    for (int i = 1; i < 2 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_get(&map, key, klen, &ivalue, &ivlen));
+        TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+    }
+
+    map_close(&map);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+static bool test_map_read() {
+    char *test_store_file = "test_map_read.store";
+
+    // Fewer slots than pages, so some reads fall back to pinning
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 16, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    char key[32], value[64], ivalue[64];
+    const int n = 2000;
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+
+    for (int optimistic = 0; optimistic < 2; optimistic++) {
+        map.optimistic = optimistic;
+        for (int i = 0; i < n; i++) {
+            int klen = snprintf(key, sizeof(key), "key%d", i);
+            int vlen = snprintf(value, sizeof(value), "value%d", i);
+
+            size_t ivlen = sizeof(ivalue);
+            TEST(map_read(&map, key, klen, ivalue, &ivlen));
+            TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+        }
+
+        size_t ivlen = sizeof(ivalue);
+        TEST(!map_read(&map, "missing", 7, ivalue, &ivlen));
+        TEST(ivlen == sizeof(ivalue));
+
+        // Ensure a value larger than the buffer isn't copied, and its length
+        // is given instead
+        ivlen = 2;
+        TEST(!map_read(&map, "key0", 4, ivalue, &ivlen));
+        TEST(ivlen == 6);
+    }
+
+    map_close(&map);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+typedef struct TestReader TestReader;
+struct TestReader {
+    Map *map;
+    int n;
+    atomic_bool *stop;
+    bool ok;
+};
+
+static void *_test_reader(void *arg) {
+    TestReader *reader = arg;
+
+    char key[32], value[64], ivalue[64];
+    reader->ok = true;
+    while (!atomic_load(reader->stop)) {
+        for (int i = 0; i < reader->n; i++) {
+            int klen = snprintf(key, sizeof(key), "key%d", i);
+            int vlen = snprintf(value, sizeof(value), "value%d", i);
+
+            size_t ivlen = sizeof(ivalue);
+            reader->ok &= map_read(reader->map, key, klen, ivalue, &ivlen) &&
+                          ivlen == (size_t)vlen &&
+                          memcmp(ivalue, value, vlen) == 0;
+        }
+    }
+
+    return NULL;
+}
+
+static bool test_map_read_concurrent() {
+    char *test_store_file = "test_map_read_concurrent.store";
+
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 32, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    char key[32], value[64];
+    const int n = 200;
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+
+    // Ensure the keys that were inserted are always found while the writer
+    // splits buckets and evicts pages under the readers
+    atomic_bool stop = false;
+    TestReader readers[2] = {
+        {.map = &map, .n = n, .stop = &stop},
+        {.map = &map, .n = n, .stop = &stop},
+    };
+    pthread_t threads[2];
+    for (int r = 0; r < 2; r++) {
+        pthread_create(&threads[r], NULL, _test_reader, &readers[r]);
+    }
+
+    bool inserted = true;
+    for (int i = n; i < 10 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        inserted &= map_insert(&map, key, klen, value, vlen);
+    }
+
+    atomic_store(&stop, true);
+    for (int r = 0; r < 2; r++) {
+        pthread_join(threads[r], NULL);
+    }
+    TEST(inserted);
+    TEST(readers[0].ok && readers[1].ok);
+
+    map_close(&map);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+static bool test_map_get_batch() {
+    char *test_store_file = "test_map_get_batch.store";
+
+    // Fewer slots than pages, so lookups in flight evict each other's buckets
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 8, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    MapLookup lookup = {.key = "key0", .klen = 4};
+    TEST(map_get_batch(&map, &lookup, 1) == 0 && !lookup.found);
+
+    const int n = 2000;
+    char(*keys)[32] = malloc(2 * n * sizeof(*keys));
+    char(*values)[64] = malloc(2 * n * sizeof(*values));
+    MapLookup *lookups = malloc(2 * n * sizeof(MapLookup));
+    for (int i = 0; i < 2 * n; i++) {
+        int klen = snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+        if (i < n) {
+            int vlen = snprintf(values[i], sizeof(values[i]), "value%d", i);
+            TEST(map_insert(&map, keys[i], klen, values[i], vlen));
+        }
+
+        lookups[i] = (MapLookup){.key = keys[i],
+                                 .klen = klen,
+                                 .value = values[i],
+                                 .vlen = sizeof(values[i])};
+    }
+
+    // Ensure every inserted key is found and every other key isn't, with more
+    // lookups than fit in a group
+    for (int readahead = 0; readahead < 2; readahead++) {
+        map.readahead = readahead;
+        TEST(map_get_batch(&map, lookups, 2 * n) == (size_t)n);
+        for (int i = 0; i < 2 * n; i++) {
+            TEST(lookups[i].found == (i < n));
+            if (i < n) {
+                char value[64];
+                int vlen = snprintf(value, sizeof(value), "value%d", i);
+                TEST(lookups[i].vlen == (size_t)vlen &&
+                     memcmp(lookups[i].value, value, vlen) == 0);
+            }
+        }
+    }
+
+    // Ensure a value larger than the buffer isn't copied
+    lookup = (MapLookup){
+        .key = "key0", .klen = 4, .value = values[0], .vlen = 2};
+    TEST(map_get_batch(&map, &lookup, 1) == 0 && !lookup.found);
+
+    free(keys);
+    free(values);
+    free(lookups);
+
+    map_close(&map);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
+
+typedef struct TestScan TestScan;
+struct TestScan {
+    int n;
+    int seen;
+    bool ok;
+};
+
+// Every entry must be an original key with its original value
+static bool _test_scan_next(void *ctx, char *key, size_t klen, char *value,
+                            size_t vlen) {
+    TestScan *scan = ctx;
+
+    char ivalue[64];
+    int i = atoi(key + 3);
+    int ivlen = snprintf(ivalue, sizeof(ivalue), "value%d", i);
+    scan->ok &= klen > 3 && i < scan->n && vlen == (size_t)ivlen &&
+                memcmp(value, ivalue, vlen) == 0;
+    scan->seen++;
+
+    return true;
+}
+
+static bool test_map_snapshot() {
+    char *test_store_file = "test_map_snapshot.store";
+    char *test_backup_file = "test_map_snapshot.backup";
+
+    // Fewer slots than pages, so changes after the snapshot are written back
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 8, &pc);
+
+    Map map = {0};
+    map_init(&map, &pc);
+
+    char key[32], value[64];
+    const int n = 500;
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+
+    DiskSnapshot snapshot = {0};
+    TEST(cache_snapshot(&pc, &snapshot));
+
+    // Replace every value and split buckets after the snapshot
+    for (int i = 0; i < 4 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "new%d", i);
+        TEST(map_insert(&map, key, klen, value, vlen));
+    }
+
+    // Ensure the scan sees the map as it was when the snapshot was taken
+    TestScan scan = {.n = n, .ok = true};
+    TEST(map_scan_snapshot(&map, &snapshot, _test_scan_next, &scan));
+    TEST(scan.ok && scan.seen == n);
+
+    // Ensure the backup opens as the map at the snapshot
+    disk_snapshot_backup(&snapshot, test_backup_file);
+    cache_snapshot_release(&pc, &snapshot);
+
+    PageCache backup_pc = {0};
+    cache_init(test_backup_file, &backup_pc);
+    Map backup = {0};
+    map_open(&backup, &backup_pc, map.directory_pid);
+
+    char *ivalue = NULL;
+    size_t ivlen = 0;
+    for (int i = 0; i < 2 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        bool found = map_get(&backup, key, klen, &ivalue, &ivlen);
+        TEST(found == (i < n));
+        if (found) {
+            TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+        }
+    }
+
+    map_close(&backup);
+    cache_close(&backup_pc);
+
+    // Ensure the map itself kept the new values
+    for (int i = 0; i < 4 * n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "new%d", i);
+        TEST(map_get(&map, key, klen, &ivalue, &ivlen) &&
+             ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+    }
+
+    map_close(&map);
+    cache_close(&pc);
+
+    remove(test_store_file);
+    remove(test_backup_file);
     return true;
 }
@@ -0,0 +1,87 @@
+#include <string.h>
+
+#include "store.h"
+#include "test.h"
+
+static bool test_store_partitions();
+
+void test_store() { test_store_partitions(); }
+
+typedef struct TestClient TestClient;
+struct TestClient {
+    Store *store;
+    size_t id;
+    int lo;
+    int hi;
+    bool ok;
+};
+
+static void *_test_client_insert(void *arg) {
+    TestClient *client = arg;
+
+    char key[32], value[64];
+    client->ok = true;
+    for (int i = client->lo; i < client->hi; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        client->ok &=
+            store_insert(client->store, client->id, key, klen, value, vlen);
+    }
+
+    return NULL;
+}
+
+static bool test_store_partitions() {
+    char *test_store_file = "test_store_partitions.store";
+    const size_t partitions = 4;
+
+    Store store = {0};
+    store_open(test_store_file, partitions, 2, &store);
+
+    // Insert from two clients at once
+    const int n = 4000;
+    TestClient clients[2] = {
+        {.store = &store, .id = 0, .lo = 0, .hi = n / 2},
+        {.store = &store, .id = 1, .lo = n / 2, .hi = n},
+    };
+    pthread_t threads[2];
+    for (int c = 0; c < 2; c++) {
+        pthread_create(&threads[c], NULL, _test_client_insert, &clients[c]);
+    }
+    for (int c = 0; c < 2; c++) {
+        pthread_join(threads[c], NULL);
+        TEST(clients[c].ok);
+    }
+
+    // Ensure every key is found and the keys are spread over the partitions
+    char key[32], value[64], ivalue[STORE_MAX_VALUE];
+    size_t ivlen = 0;
+    size_t counts[4] = {0};
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(value, sizeof(value), "value%d", i);
+        TEST(store_get(&store, 1, key, klen, ivalue, &ivlen));
+        TEST(ivlen == (size_t)vlen && memcmp(ivalue, value, vlen) == 0);
+
+        counts[store_partition(&store, key, klen)]++;
+    }
+    for (size_t p = 0; p < partitions; p++) {
+        TEST(counts[p] > n / partitions / 2);
+    }
+    TEST(!store_get(&store, 0, "missing", 7, ivalue, &ivlen));
+    TEST(ivlen == 0);
+
+    // Ensure a value too long to copy out is told apart from a missing key. No
+    // requests are in flight, so the owning partition's map can be written
+    char large[STORE_MAX_VALUE + 1];
+    memset(large, 'a', sizeof(large));
+    StorePartition *part = &store.parts[store_partition(&store, "large", 5)];
+    TEST(map_insert(&part->map, "large", 5, large, sizeof(large)));
+    TEST(!store_get(&store, 0, "large", 5, ivalue, &ivlen));
+    TEST(ivlen == sizeof(large));
+
+    store_close(&store);
+
+    test_remove(test_store_file);
+    return true;
+}
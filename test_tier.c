@@ -0,0 +1,233 @@
+#include <string.h>
+
+#include "cache.h"
+#include "lz.h"
+#include "test.h"
+#include "tier.h"
+
+static bool test_lz_round_trip();
+static bool test_tier_budget();
+static bool test_tier_cache();
+
+void test_tier() {
+    test_lz_round_trip();
+    test_tier_budget();
+    test_tier_cache();
+}
+
+static uint64_t _next(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1d;
+}
+
+// A page like a bucket: a header, repetitive entries and a zeroed tail
+static void _fill_page(char *page, uint64_t seed) {
+    memset(page, 0, PAGE_SIZE);
+    memcpy(page, &seed, sizeof(seed));
+    char *current = page + sizeof(seed);
+    for (uint64_t i = 0; i < 40; i++) {
+        current += snprintf(current, 64, "key%llu|value%llu;",
+                            (unsigned long long)(seed * 40 + i),
+                            (unsigned long long)i);
+    }
+}
+
+static bool test_lz_round_trip() {
+    char *test_store_file = "";
+
+    char src[PAGE_SIZE], dst[2 * PAGE_SIZE], out[PAGE_SIZE];
+
+    // Ensure every length of a short input comes back the same
+    memcpy(src, "aaaaaaaaabcabcabcabcd", 21);
+    for (size_t n = 0; n <= 21; n++) {
+        size_t len = lz_compress(src, n, dst, sizeof(dst));
+        TEST(len > 0);
+        TEST(lz_decompress(dst, len, out, n));
+        TEST(memcmp(src, out, n) == 0);
+    }
+
+    // Ensure a page of zeros shrinks to a few bytes, with long lengths
+    memset(src, 0, PAGE_SIZE);
+    size_t len = lz_compress(src, PAGE_SIZE, dst, sizeof(dst));
+    TEST(len > 0 && len < 32);
+    TEST(lz_decompress(dst, len, out, PAGE_SIZE));
+    TEST(memcmp(src, out, PAGE_SIZE) == 0);
+
+    // Ensure a bucket-like page compresses well
+    _fill_page(src, 7);
+    len = lz_compress(src, PAGE_SIZE, dst, sizeof(dst));
+    TEST(len > 0 && len < PAGE_SIZE / 2);
+    TEST(lz_decompress(dst, len, out, PAGE_SIZE));
+    TEST(memcmp(src, out, PAGE_SIZE) == 0);
+
+    // Ensure random data is rejected if it doesn't shrink, and otherwise still
+    // round trips
+    uint64_t state = 1;
+    for (size_t i = 0; i < PAGE_SIZE; i += sizeof(uint64_t)) {
+        uint64_t x = _next(&state);
+        memcpy(src + i, &x, sizeof(x));
+    }
+    TEST(lz_compress(src, PAGE_SIZE, dst, PAGE_SIZE) == 0);
+    len = lz_compress(src, PAGE_SIZE, dst, sizeof(dst));
+    TEST(len > PAGE_SIZE);
+    TEST(lz_decompress(dst, len, out, PAGE_SIZE));
+    TEST(memcmp(src, out, PAGE_SIZE) == 0);
+
+    // Ensure inputs of every size made of runs and short repeats round trip
+    for (size_t round = 0; round < 200; round++) {
+        size_t n = _next(&state) % PAGE_SIZE;
+        size_t alphabet = 1 + _next(&state) % 4;
+        for (size_t i = 0; i < n; i++) {
+            src[i] = 'a' + _next(&state) % alphabet;
+        }
+
+        len = lz_compress(src, n, dst, sizeof(dst));
+        TEST(len > 0);
+        TEST(lz_decompress(dst, len, out, n));
+        TEST(memcmp(src, out, n) == 0);
+    }
+
+    // Ensure malformed input is refused rather than overrunning the output
+    _fill_page(src, 7);
+    len = lz_compress(src, PAGE_SIZE, dst, sizeof(dst));
+    TEST(!lz_decompress(dst, len / 2, out, PAGE_SIZE));
+    TEST(!lz_decompress(dst, len, out, PAGE_SIZE - 1));
+    char bad[] = {0x10, 'a', 0x05, 0x00};
+    TEST(!lz_decompress(bad, sizeof(bad), out, PAGE_SIZE));
+
+    return true;
+}
+
+static bool test_tier_budget() {
+    char *test_store_file = "";
+
+    char page[PAGE_SIZE], out[PAGE_SIZE];
+    _fill_page(page, 0);
+    size_t entry = lz_compress(page, PAGE_SIZE, out, sizeof(out));
+
+    // Room for about four pages
+    Tier tier = {0};
+    tier_init(&tier, 4 * entry + entry / 2);
+
+    for (pageid_t pid = 2; pid < 6; pid++) {
+        _fill_page(page, pid);
+        tier_put(&tier, pid, page);
+    }
+    TEST(tier.stats.puts == 4 && tier.stats.evictions == 0);
+
+    // Ensure a referenced page survives the next eviction
+    TEST(tier_get(&tier, 2, out));
+    _fill_page(page, 2);
+    TEST(memcmp(page, out, PAGE_SIZE) == 0);
+
+    _fill_page(page, 6);
+    tier_put(&tier, 6, page);
+    TEST(tier.stats.evictions == 1);
+    TEST(tier.used <= tier.budget);
+    TEST(tier_get(&tier, 2, out));
+    TEST(!tier_get(&tier, 3, out));
+    TEST(tier_get(&tier, 6, out));
+    TEST(memcmp(page, out, PAGE_SIZE) == 0);
+
+    // Ensure a removed page is gone and pages that don't compress are refused
+    tier_remove(&tier, 6);
+    TEST(!tier_get(&tier, 6, out));
+
+    uint64_t state = 1;
+    for (size_t i = 0; i < PAGE_SIZE; i += sizeof(uint64_t)) {
+        uint64_t x = _next(&state);
+        memcpy(page + i, &x, sizeof(x));
+    }
+    tier_put(&tier, 7, page);
+    TEST(tier.stats.rejected == 1);
+    TEST(!tier_get(&tier, 7, out));
+
+    tier_close(&tier);
+
+    return true;
+}
+
+static bool test_tier_cache() {
+    char *test_store_file = "test_tier_cache.store";
+
+    PageCache pc = {0};
+    cache_init_slots(test_store_file, 4, &pc);
+    cache_tier_init(&pc, 16 * PAGE_SIZE);
+
+    // Write more pages than the pool holds so the older ones are evicted into
+    // the tier
+    Page *page = NULL;
+    const size_t n = 16;
+    for (size_t i = 0; i < n; i++) {
+        TEST(cache_new_page(&pc, &page));
+        _fill_page(page->data, i);
+        page->dirty = true;
+        cache_unpin(&pc, page);
+    }
+
+    // Ensure the evicted pages come back from the tier
+    char expected[PAGE_SIZE];
+    size_t misses = pc.tier->stats.misses;
+    for (size_t i = 0; i < n - 4; i++) {
+        TEST(cache_fetch_page(&pc, FREE_LIST_PAGE_ID + 1 + i, &page));
+        _fill_page(expected, i);
+        TEST(memcmp(page->data, expected, PAGE_SIZE) == 0);
+        cache_unpin(&pc, page);
+    }
+    TEST(pc.tier->stats.hits == n - 4);
+    TEST(pc.tier->stats.misses == misses);
+
+    // Ensure a page changed after it came from the tier isn't served from its
+    // old copy, whether it is written back on eviction or flushed first
+    for (size_t flush = 0; flush < 2; flush++) {
+        pageid_t pid = FREE_LIST_PAGE_ID + 1 + flush;
+        TEST(cache_fetch_page(&pc, pid, &page));
+        _fill_page(page->data, 100 + flush);
+        page->dirty = true;
+        if (flush) {
+            cache_flush_page(&pc, page);
+        }
+        cache_unpin(&pc, page);
+
+        for (size_t i = n - 4; i < n; i++) {
+            TEST(cache_fetch_page(&pc, FREE_LIST_PAGE_ID + 1 + i, &page));
+            cache_unpin(&pc, page);
+        }
+
+        TEST(cache_fetch_page(&pc, pid, &page));
+        _fill_page(expected, 100 + flush);
+        TEST(memcmp(page->data, expected, PAGE_SIZE) == 0);
+        cache_unpin(&pc, page);
+    }
+
+    // Ensure pages written around the pool aren't served from the tier's old
+    // copies, whether freed and allocated again or written as a run
+    for (size_t i = n - 4; i < n; i++) {
+        TEST(cache_fetch_page(&pc, FREE_LIST_PAGE_ID + 1 + i, &page));
+        cache_unpin(&pc, page);
+    }
+    pageid_t pid = FREE_LIST_PAGE_ID + 1 + 4;
+    TEST(tier_get(pc.tier, pid, expected));
+    TEST(tier_get(pc.tier, pid + 1, expected));
+
+    _fill_page(expected, 200);
+    disk_write(&pc.dm, pid, expected);
+    TEST(disk_free_run(&pc.dm, pid, 1));
+    TEST(cache_new_page(&pc, &page));
+    TEST(page->pid == pid);
+    TEST(memcmp(page->data, expected, PAGE_SIZE) == 0);
+    cache_unpin(&pc, page);
+
+    _fill_page(expected, 201);
+    cache_write_pages(&pc, pid + 1, 1, expected);
+    TEST(cache_fetch_page(&pc, pid + 1, &page));
+    TEST(memcmp(page->data, expected, PAGE_SIZE) == 0);
+    cache_unpin(&pc, page);
+
+    cache_close(&pc);
+
+    remove(test_store_file);
+    return true;
+}
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+#include "tier.h"
+
+static void _tier_drop(Tier *tier, uint32_t e) {
+    TierEntry *entry = &tier->entries[e];
+    tier->used -= entry->len;
+    free(entry->data);
+    *entry = (TierEntry){0};
+
+    clock_index_remove(&tier->clock, e);
+}
+
+// Drop the entry the clock picks. Returns false if the tier is empty
+static bool _tier_evict(Tier *tier) {
+    uint32_t e = 0;
+    if (!clock_index_victim(&tier->clock, &e)) {
+        return false;
+    }
+
+    _tier_drop(tier, e);
+    tier->stats.evictions++;
+    return true;
+}
+
+void tier_init(Tier *tier, size_t budget) {
+    *tier = (Tier){.budget = budget};
+
+    size_t capacity = budget / TIER_ENTRY_BUDGET;
+    if (capacity == 0) {
+        capacity = 1;
+    }
+    tier->entries = calloc(capacity, sizeof(TierEntry));
+
+    // A pid is its own hash, so no entries need comparing
+    clock_index_init(&tier->clock, capacity, NULL, NULL);
+
+    return;
+}
+
+void tier_close(Tier *tier) {
+    for (size_t i = 0; i < tier->clock.capacity; i++) {
+        free(tier->entries[i].data);
+    }
+    free(tier->entries);
+    clock_index_close(&tier->clock);
+
+    *tier = (Tier){0};
+
+    return;
+}
+
+void tier_put(Tier *tier, pageid_t pid, const char *data) {
+    uint32_t e = 0;
+    if (clock_index_find(&tier->clock, pid, NULL, 0, &e)) {
+        clock_index_reference(&tier->clock, e);
+        return;
+    }
+
+    char buf[TIER_MAX_ENTRY];
+    size_t len = lz_compress(data, PAGE_SIZE, buf, sizeof(buf));
+    if (len == 0 || len > tier->budget) {
+        tier->stats.rejected++;
+        return;
+    }
+
+    while (tier->used + len > tier->budget ||
+           !clock_index_insert(&tier->clock, pid, &e)) {
+        if (!_tier_evict(tier)) {
+            tier->stats.rejected++;
+            return;
+        }
+    }
+
+    tier->entries[e] = (TierEntry){.pid = pid, .len = len, .data = malloc(len)};
+    memcpy(tier->entries[e].data, buf, len);
+    tier->used += len;
+
+    tier->stats.puts++;
+    tier->stats.bytes_in += PAGE_SIZE;
+    tier->stats.bytes_stored += len;
+
+    return;
+}
+
+bool tier_get(Tier *tier, pageid_t pid, char *data) {
+    uint32_t e = 0;
+    if (!clock_index_find(&tier->clock, pid, NULL, 0, &e)) {
+        tier->stats.misses++;
+        return false;
+    }
+
+    TierEntry *entry = &tier->entries[e];
+    if (!lz_decompress(entry->data, entry->len, data, PAGE_SIZE)) {
+        _tier_drop(tier, e);
+        tier->stats.misses++;
+        return false;
+    }
+
+    clock_index_reference(&tier->clock, e);
+    tier->stats.hits++;
+
+    return true;
+}
+
+void tier_remove(Tier *tier, pageid_t pid) {
+    uint32_t e = 0;
+    if (clock_index_find(&tier->clock, pid, NULL, 0, &e)) {
+        _tier_drop(tier, e);
+    }
+
+    return;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "disk.h"
+
+// A second tier of the page cache holding compressed copies of the pages the
+// frame pool evicts, within a memory budget. A page that doesn't compress to
+// TIER_MAX_ENTRY bytes isn't worth the space and is left to the disk. Entries
+// are found by pid and replaced with CLOCK through a ClockIndex
+#define TIER_MAX_ENTRY (PAGE_SIZE / 2)
+#define TIER_ENTRY_BUDGET 256 /* bytes of budget per entry, bounds the count */
+
+typedef struct TierStats TierStats;
+struct TierStats {
+    size_t hits;
+    size_t misses;
+    size_t puts;
+    size_t rejected; /* pages that didn't compress well enough */
+    size_t evictions;
+    size_t bytes_in;     /* uncompressed bytes of the pages put */
+    size_t bytes_stored; /* compressed bytes of the pages put */
+};
+
+typedef struct TierEntry TierEntry;
+struct TierEntry {
+    pageid_t pid;
+    uint32_t len;
+    char *data; /* NULL if the entry is unused */
+};
+
+typedef struct Tier Tier;
+struct Tier {
+    size_t budget;
+    size_t used; /* compressed bytes held */
+    TierEntry *entries;
+    ClockIndex clock; /* over the entries, by pid */
+    TierStats stats;
+};
+
+// Initialise a tier holding up to the given number of bytes
+void tier_init(Tier *, size_t);
+void tier_close(Tier *);
+// Keep a compressed copy of the page. A page that is already held only has its
+// reference set, so the caller must remove a page before its content changes
+void tier_put(Tier *, pageid_t, const char *);
+// Decompress the page into data. Returns false if it isn't held
+bool tier_get(Tier *, pageid_t, char *);
+void tier_remove(Tier *, pageid_t);